@@ -1,11 +1,41 @@
 #include "adc.h"
 #include "stm32f0xx.h"
+#include "event.h"
+#include "gpio.h"
 
 
 /*
+ * TIM3 update events (TRGO) start the conversion of a sequence, DMA 
+ * channel 1 moves the results to a circular buffer, and interrupts at 
+ * half and full transfer hand the block just completed to the handler.
+ * The CPU only runs once per ADC_BLOCK sequences.
+ *
+ * In low power mode (adc_set_low_power()) the ADC powers itself down 
+ * between sequences (AUTOFF), with HSI14 only running while the ADC 
+ * requests it, and the VBAT divider is only switched on ADC_SETTLE 
+ * before each trigger, by the TIM3 compare interrupt, then off again
+ * at the end of the sequence. At rates where a period is not longer 
+ * than ADC_SETTLE, the divider stays on. Per sequence, with the 
+ * datasheet typical values:
+ *   conversions  3 x 252 cycles at 14 MHz = 54 us, at about 1 mA
+ *                (analog and HSI14), 54 nC
+ *   divider      on ADC_SETTLE + 54 us, 1.05 ms instead of 1/rate
+ *   CPU          2 interrupts, under 2 us each at 48 MHz
+ * At 16 sequences per second, ADC and HSI14 go from about 1 mA down to 
+ * under 1 uA on average, and the divider current drops by a factor 60.
+ * The calibration is run once by adc_init(): it survives AUTOFF and the
+ * ADC stays enabled, so it is never repeated.
  */
 
-#define NUMBER_OF_ADC_INPUTS 2
+#define ADC_TIMER_CLOCK 10000   // TIM3 tick, in Hz
+#define ADC_SETTLE      10      // divider settling time, in TIM3 ticks
+
+static uint16_t adc_samples[2*ADC_BLOCK*ADC_CHANNELS];
+
+static void (*adc_block_handler)(const uint16_t *samples);
+
+static uint32_t adc_rate;
+static int adc_low_power;
 
 void adc_init(void)
 {
@@ -72,29 +102,222 @@ void adc_init(void)
 
   /*** CONFIGURE CHANNELS FOR ADC ***/
   ADC1->CFGR2 &= ~ADC_CFGR2_CKMODE;  // Select HSI14 by writing 00 in CKMODE (reset value)
-  //ADC1->CFGR1 |= ADC_CFGR1_EXTEN_0 // 2^0 -> on rising edge (EXTEN=01) 
-  //    | ADC_CFGR1_EXTSEL_1         // 2^1 -> 010 
-  //    | ADC_CFGR1_EXTSEL_0         // 2^0 -> 001 
-  //                                 //     =  011 -> *** TRG3, source is TIM3_TRGO *** trigger on timer3
-  //    ;                            // Setting ADC_CFGR1_SCANDIR would result in channels scanning from top to bottom
+  ADC1->CFGR1 |= ADC_CFGR1_EXTEN_0 // 2^0 -> on rising edge (EXTEN=01) 
+      | ADC_CFGR1_EXTSEL_1         // 2^1 -> 010 
+      | ADC_CFGR1_EXTSEL_0         // 2^0 -> 001 
+                                   //     =  011 -> *** TRG3, source is TIM3_TRGO *** trigger on timer3
+      | ADC_CFGR1_DMAEN            // results moved by DMA
+      | ADC_CFGR1_DMACFG           // in circular mode
+      ;                            // Setting ADC_CFGR1_SCANDIR would result in channels scanning from top to bottom
   ADC1->CHSELR = ADC_CHSELR_CHSEL6    // Select ADC_IN6
+    | ADC_CHSELR_CHSEL16            // Select ADC_IN16
     | ADC_CHSELR_CHSEL17            // Select ADC_IN17
     ;
   ADC1->SMPR |= ADC_SMPR_SMP_0 | ADC_SMPR_SMP_1 | ADC_SMPR_SMP_2; // 111 is 239.5 ADC clk
 
   ADC->CCR |= ADC_CCR_VREFEN;     // Enable internal voltage reference a.k.a. ADC_IN17
+  ADC->CCR |= ADC_CCR_TSEN;       // Enable temperature sensor a.k.a. ADC_IN16
+
+  /*** CONFIGURE DMA CHANNEL 1 ***/
+  RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+  DMA1_Channel1->CPAR = (uint32_t)&(ADC1->DR);
+  DMA1_Channel1->CMAR = (uint32_t)adc_samples;
+  DMA1_Channel1->CCR = DMA_CCR_MINC | DMA_CCR_CIRC
+    | DMA_CCR_PSIZE_0 | DMA_CCR_MSIZE_0   // 16-bit transfers
+    | DMA_CCR_HTIE | DMA_CCR_TCIE;
+  NVIC_SetPriority(DMA1_Channel1_IRQn, 2); // below the I2C slave
+  NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+
+  /*** ANALOG WATCHDOG ***/
+  NVIC_SetPriority(ADC1_IRQn, 2);
+  NVIC_EnableIRQ(ADC1_IRQn);
+
+  /*** CONFIGURE TIM3 ***/
+  RCC->APB1ENR |= RCC_APB1ENR_TIM3EN;
+  TIM3->PSC = SystemCoreClock/ADC_TIMER_CLOCK - 1;
+  TIM3->CR2 = TIM_CR2_MMS_1;      // MMS=010: update event is TRGO
+  NVIC_SetPriority(TIM3_IRQn, 2);
+  NVIC_EnableIRQ(TIM3_IRQn);
+}
+
+void adc_set_low_power(int enable)
+{
+  // AUTOFF and WAIT can only be written with ADSTART=0
+  int running = (ADC1->CR & ADC_CR_ADSTART) != 0;
+
+  adc_stop();
+  adc_low_power = enable;
+
+  if (enable)
+  {
+    ADC1->CFGR1 |= ADC_CFGR1_AUTOFF | ADC_CFGR1_WAIT;
+    RCC->CR2 &= ~(RCC_CR2_HSI14ON | RCC_CR2_HSI14DIS); // on ADC request only
+  }
+  else
+  {
+    RCC->CR2 |= RCC_CR2_HSI14ON;
+    while ((RCC->CR2 & RCC_CR2_HSI14RDY) == 0)
+    {
+      /* Wait */
+    }
+    ADC1->CFGR1 &= ~(ADC_CFGR1_AUTOFF | ADC_CFGR1_WAIT);
+  }
+
+  if (running)
+    adc_start(adc_rate);
+}
+
+void adc_set_block_handler(void (*handler)(const uint16_t *samples))
+{
+  adc_block_handler = handler;
 }
 
-void adc_acquire(uint16_t *result)
+void adc_start(uint32_t rate)
 {
-    ADC1->CR |= ADC_CR_ADSTART; 
-    for (int i=0; i<NUMBER_OF_ADC_INPUTS;i++)
+  adc_stop();
+  adc_rate = rate;
+
+  DMA1->IFCR = DMA_IFCR_CGIF1;
+  DMA1_Channel1->CNDTR = 2*ADC_BLOCK*ADC_CHANNELS;
+  DMA1_Channel1->CCR |= DMA_CCR_EN;
+
+  // conversions wait for the trigger
+  ADC1->CR |= ADC_CR_ADSTART;
+
+  TIM3->ARR = ADC_TIMER_CLOCK/rate - 1;
+  TIM3->CNT = 0;
+  if (adc_low_power && TIM3->ARR >= ADC_SETTLE)
+  {
+    // divider on ADC_SETTLE before the update event, off at EOSEQ
+    TIM3->CCR1 = TIM3->ARR + 1 - ADC_SETTLE;
+    TIM3->SR = ~TIM_SR_CC1IF;
+    TIM3->DIER |= TIM_DIER_CC1IE;
+    ADC1->ISR = ADC_ISR_EOSEQ;
+    ADC1->IER |= ADC_IER_EOSEQIE;
+  }
+  else
+  {
+    // no time to settle between sequences, the first one comes a full
+    // period after this
+    gpio_set(GPIO_OUT_ADC_BAT);
+  }
+  TIM3->CR1 |= TIM_CR1_CEN;
+}
+
+void adc_stop(void)
+{
+  TIM3->CR1 &= ~TIM_CR1_CEN;
+
+  if ((ADC1->CR & ADC_CR_ADSTART) != 0)
+  {
+    ADC1->CR |= ADC_CR_ADSTP;
+    while ((ADC1->CR & ADC_CR_ADSTP) != 0)
     {
-        while ((ADC1->ISR & ADC_ISR_EOC) == 0)
-        {
-            /* Wait */
-        }
-        result[i] = ADC1->DR;
+      /* Wait */
     }
-    
+  }
+  DMA1_Channel1->CCR &= ~DMA_CCR_EN;
+
+  TIM3->DIER &= ~TIM_DIER_CC1IE;
+  ADC1->IER &= ~ADC_IER_EOSEQIE;
+  gpio_clear(GPIO_OUT_ADC_BAT);
+}
+
+uint32_t adc_millivolts(uint32_t sample, uint32_t vref, uint32_t vref_cal)
+{
+  uint32_t vdda;
+
+  if (vref == 0)
+    return 0;
+
+  // VDDA = 3.3 V * VREFINT_CAL / VREFINT, VREFINT_CAL scaled to 14 bits
+  vdda = 3300*4*vref_cal / vref;
+  return (vdda*sample + 2*4095) / (4*4095);
+}
+
+int32_t adc_temperature(uint32_t sample, uint32_t vref, uint32_t vref_cal)
+{
+  int32_t delta;
+
+  if (vref == 0)
+    return 0;
+
+  // sample as it would read at VDDA = 3.3 V, minus TS_CAL1, in 14 bits
+  delta = 4*(int32_t)TS_CAL1 - (int32_t)(sample*4*vref_cal / vref);
+
+  // 3300 mV / 16380 per LSB, 4.3 mV/degC: 10*3300/(16380*4.3) = 3300/7043
+  return 300 + (delta*3300 + (delta < 0 ? -7043/2 : 7043/2)) / 7043;
+}
+
+uint32_t adc_threshold(uint32_t mv, uint32_t vref, uint32_t vref_cal)
+{
+  uint32_t sample;
+
+  if (vref_cal == 0)
+    return 0;
+
+  // the input relative to VDDA, scaled by 64 to keep the precision
+  sample = 64*mv*vref / vref_cal;
+  sample = (sample*4095 + 64*3300/2) / (64*3300);
+  return sample > 4095 ? 4095 : sample;
+}
+
+void adc_set_watchdog(uint32_t low, uint32_t high)
+{
+  // TR and the AWD bits of CFGR1 can only be written with ADSTART=0
+  int running = (ADC1->CR & ADC_CR_ADSTART) != 0;
+
+  adc_stop();
+
+  ADC1->IER &= ~ADC_IER_AWDIE;
+  ADC1->CFGR1 &= ~(ADC_CFGR1_AWDEN | ADC_CFGR1_AWDSGL | ADC_CFGR1_AWDCH);
+  ADC1->ISR = ADC_ISR_AWD;
+  if (low > 0 || high < 4095)
+  {
+    ADC1->TR = (high << 16) | low;
+    ADC1->CFGR1 |= ADC_CFGR1_AWDEN | ADC_CFGR1_AWDSGL  // single channel
+      | ADC_CFGR1_AWDCH_2 | ADC_CFGR1_AWDCH_1;        // 00110 is ADC_IN6
+    ADC1->IER |= ADC_IER_AWDIE;
+  }
+
+  if (running)
+    adc_start(adc_rate);
+}
+
+void ADC1_IRQHandler(void)
+{
+  uint32_t status = ADC1->ISR & ADC1->IER;
+
+  if ((status & ADC_ISR_EOSEQ) != 0)
+  {
+    ADC1->ISR = ADC_ISR_EOSEQ;
+    gpio_clear(GPIO_OUT_ADC_BAT);
+  }
+  if ((status & ADC_ISR_AWD) != 0)
+  {
+    // one event per crossing, until the window is set again
+    ADC1->IER &= ~ADC_IER_AWDIE;
+    ADC1->ISR = ADC_ISR_AWD;
+    event_raise(EVENT_ADC_WATCHDOG);
+  }
+}
+
+void TIM3_IRQHandler(void)
+{
+  TIM3->SR = ~TIM_SR_CC1IF;
+  gpio_set(GPIO_OUT_ADC_BAT);
+}
+
+void DMA1_Channel1_IRQHandler(void)
+{
+  uint32_t status = DMA1->ISR;
+
+  DMA1->IFCR = status & (DMA_ISR_HTIF1 | DMA_ISR_TCIF1);
+
+  if (adc_block_handler == 0)
+    return;
+  if ((status & DMA_ISR_HTIF1) != 0)
+    adc_block_handler(adc_samples);
+  if ((status & DMA_ISR_TCIF1) != 0)
+    adc_block_handler(adc_samples + ADC_BLOCK*ADC_CHANNELS);
 }
@@ -3,11 +3,52 @@
 
 #include <stdint.h>
 
+// Channels of a sequence, in conversion order: ADC_IN6 (VBAT), ADC_IN16
+// (temperature sensor) then ADC_IN17 (VREFINT)
+#define ADC_CHANNELS 3
+
+// Sequences handed over at a time, half of the DMA buffer. Summing 
+// the 16 samples of a channel and dividing by 4 gives a 14-bit result.
+#define ADC_BLOCK 16
+
 void adc_init(void);
 
+// Convert one sequence every 1/rate second, paced by TIM3, results are 
+// written to a circular buffer by DMA channel 1.
+void adc_start(uint32_t rate);
+
+void adc_stop(void);
 
-void adc_acquire(uint16_t *result);
+// Power the ADC, HSI14 and the VBAT divider only around conversions, see
+// adc.c. Conversions are restarted, the current block is lost.
+void adc_set_low_power(int enable);
+
+// Called from the DMA interrupt handler with ADC_BLOCK sequences of
+// ADC_CHANNELS samples each, while DMA fills the other half of the buffer
+void adc_set_block_handler(void (*handler)(const uint16_t *samples));
 
 #define VREFINT_CAL (*((uint16_t *)(0x1FFFF7BA)))
 
+// Voltage in mV at an input, from 14-bit results for the input and for 
+// VREFINT, and from VREFINT_CAL (12 bits at VDDA = 3.3 V).
+uint32_t adc_millivolts(uint32_t sample, uint32_t vref, uint32_t vref_cal);
+
+#define TS_CAL1 (*((uint16_t *)(0x1FFFF7B8)))
+
+// Temperature in 0.1 degC, from 14-bit results for the sensor and for 
+// VREFINT, and from VREFINT_CAL. TS_CAL1 is the sensor at 30 degC and 
+// VDDA = 3.3 V, the slope is the typical 4.3 mV/degC (the F030 has no 
+// TS_CAL2).
+int32_t adc_temperature(uint32_t sample, uint32_t vref, uint32_t vref_cal);
+
+// 12-bit result expected for an input at mv millivolts, the inverse of
+// adc_millivolts() for a 12-bit VREFINT result.
+uint32_t adc_threshold(uint32_t mv, uint32_t vref, uint32_t vref_cal);
+
+// Analog watchdog on ADC_IN6: EVENT_ADC_WATCHDOG is raised as soon as a
+// single conversion falls outside [low, high] (12-bit results), then the
+// watchdog stays quiet until set again. The window [0, 4095] disables it.
+// Conversions are restarted, the current block is lost.
+void adc_set_watchdog(uint32_t low, uint32_t high);
+
 #endif
@@ -0,0 +1,42 @@
+#include <stm32f0xx.h>
+#include "event.h"
+
+static volatile uint32_t Pending;
+
+void event_raise(uint32_t events)
+{
+    // The M0 has no exclusive load/store, so mask interrupts for the
+    // read-modify-write. PRIMASK is restored as we may already be in
+    // an interrupt handler or in a masked section.
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    Pending |= events;
+    __set_PRIMASK(primask);
+}
+
+uint32_t event_pending(void)
+{
+    return Pending;
+}
+
+uint32_t event_wait(void)
+{
+    uint32_t events;
+
+    __disable_irq();
+    while (Pending == 0)
+    {
+        // WFI with PRIMASK set still wakes up on a pending interrupt, 
+        // so an event raised after the test above cannot be missed.
+        // The handler itself runs once interrupts are re-enabled.
+        __WFI();
+        __enable_irq();
+        __disable_irq();
+    }
+    events = Pending;
+    Pending = 0;
+    __enable_irq();
+
+    return events;
+}
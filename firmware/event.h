@@ -0,0 +1,28 @@
+#ifndef _EVENT_H_
+#define _EVENT_H_
+
+#include <stdint.h>
+
+/* Pending-event flags, raised from interrupt handlers and consumed
+ * by the main loop.
+ */
+#define EVENT_TICK          0x01    // timebase deadline reached
+#define EVENT_I2C_RX        0x02    // i2c write transaction completed
+#define EVENT_I2C_TX        0x04    // i2c read transaction completed
+#define EVENT_BUTTON        0x08    // button edge
+#define EVENT_RTC           0x10    // RTC alarm
+#define EVENT_WATCHDOG      0x20    // rising edge on watchdog pin
+#define EVENT_STATUS        0x40    // edge on a charger status pin
+#define EVENT_USART         0x80    // character received on the console
+#define EVENT_I2C_ERROR     0x100   // i2c transaction rejected
+#define EVENT_ADC           0x200   // block of ADC samples filtered
+#define EVENT_ADC_WATCHDOG  0x400   // VBAT outside the analog watchdog window
+#define EVENT_I2C_RELEASE   0x800   // i2c snapshot image no longer read
+
+void event_raise(uint32_t events);
+
+uint32_t event_pending(void);
+
+uint32_t event_wait(void);
+
+#endif
@@ -0,0 +1,47 @@
+#include "filter.h"
+
+/* Fixed-point filter for slowly varying measurements: an optional 
+ * median of 3, which drops isolated spikes, followed by a first order
+ * IIR low-pass, y += (x - y) / 2^n, kept with FILTER_FRAC extra bits so
+ * that small steps are not lost to rounding.
+ */
+
+#define FILTER_FRAC 8
+
+void filter_reset(filter_t *filter)
+{
+    filter->state = 0;
+    filter->count = 0;
+}
+
+static uint16_t median3(uint16_t a, uint16_t b, uint16_t c)
+{
+    if (a > b) { uint16_t t = a; a = b; b = t; }
+    if (b > c) b = c;
+    return a > b ? a : b;
+}
+
+uint32_t filter_update(filter_t *filter, uint16_t input, uint8_t config)
+{
+    uint32_t x;
+    uint32_t shift = config & FILTER_SHIFT;
+
+    filter->last[2] = filter->last[1];
+    filter->last[1] = filter->last[0];
+    filter->last[0] = input;
+    if (filter->count < 3)
+        filter->count++;
+
+    x = input;
+    if ((config & FILTER_MEDIAN) != 0 && filter->count == 3)
+        x = median3(filter->last[0], filter->last[1], filter->last[2]);
+    x <<= FILTER_FRAC;
+
+    // Start from the first input rather than from 0
+    if (filter->count == 1)
+        filter->state = x;
+    else
+        filter->state = filter->state - (filter->state >> shift) + (x >> shift);
+
+    return (filter->state + (1<<(FILTER_FRAC-1))) >> FILTER_FRAC;
+}
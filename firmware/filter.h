@@ -0,0 +1,21 @@
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <stdint.h>
+
+// Filter configuration byte
+#define FILTER_SHIFT        0x07    // IIR coefficient 1/2^n, 0 for no IIR
+#define FILTER_MEDIAN       0x80    // median of the last 3 inputs first
+
+typedef struct {
+    uint32_t state;         // IIR output, with 8 fraction bits
+    uint16_t last[3];       // last inputs, for the median
+    uint8_t count;          // inputs so far, up to 3
+} filter_t;
+
+void filter_reset(filter_t *filter);
+
+// Feed one input, returns the filtered value
+uint32_t filter_update(filter_t *filter, uint16_t input, uint8_t config);
+
+#endif
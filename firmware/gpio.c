@@ -24,5 +24,11 @@ extern void gpio_enable_analog(uint32_t gpio);
 
 extern void gpio_enable_alternate_function(uint32_t gpio, uint32_t af);
 
+extern void gpio_enable_interrupt(uint32_t gpio, uint32_t edge);
+
+extern uint32_t gpio_interrupt_pending(uint32_t gpio);
+
+extern void gpio_clear_interrupt(uint32_t gpio);
+
 
 
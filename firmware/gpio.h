@@ -117,6 +117,40 @@ INLINE void gpio_enable_alternate_function(uint32_t gpio, uint32_t af)
     PORT(gpio)->AFR[PIN(gpio) >> 3] |= af << ((PIN(gpio) & 0x7) << 2); 
 }
 
+#define GPIO_EDGE_RISING    1
+#define GPIO_EDGE_FALLING   2
+
+INLINE void gpio_enable_interrupt(uint32_t gpio, uint32_t edge)
+{
+    RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+
+    SYSCFG->EXTICR[PIN(gpio) >> 2] &= ~(0xF << ((PIN(gpio) & 0x3) << 2));
+    SYSCFG->EXTICR[PIN(gpio) >> 2] |= (gpio >> 5) << ((PIN(gpio) & 0x3) << 2);
+
+    if (edge & GPIO_EDGE_RISING)
+        EXTI->RTSR |= (1<<PIN(gpio));
+    else
+        EXTI->RTSR &= ~(1<<PIN(gpio));
+
+    if (edge & GPIO_EDGE_FALLING)
+        EXTI->FTSR |= (1<<PIN(gpio));
+    else
+        EXTI->FTSR &= ~(1<<PIN(gpio));
+
+    EXTI->PR = (1<<PIN(gpio));
+    EXTI->IMR |= (1<<PIN(gpio));
+}
+
+INLINE uint32_t gpio_interrupt_pending(uint32_t gpio)
+{
+    return (EXTI->PR >> PIN(gpio)) & 1;
+}
+
+INLINE void gpio_clear_interrupt(uint32_t gpio)
+{
+    EXTI->PR = (1<<PIN(gpio));
+}
+
 // Port A
 #define GPIO_IN_PG          GPIO_A(0)
 #define GPIO_IN_STAT2       GPIO_A(2)
@@ -135,6 +169,7 @@ INLINE void gpio_enable_alternate_function(uint32_t gpio, uint32_t af)
 #define GPIO_I2C_SDA        GPIO_B(9)
 #define GPIO_IN_PG2         GPIO_B(14)
 #define GPIO_TP2            GPIO_B(15)
+#define GPIO_OUT_INT        GPIO_TP2    // interrupt line to the host, when enabled
 // PORT C
 #define GPIO_IN_BUTTON      GPIO_C(13)
 
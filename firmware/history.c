@@ -0,0 +1,127 @@
+#include "history.h"
+#include "stm32f0xx.h"
+
+/* Per-minute minimum, average and maximum of a measurement, in a ring 
+ * of 2-byte entries. Averages are delta-encoded against the value the
+ * reader reconstructs, not the true previous average, so that a step 
+ * larger than the int8 range catches up over the next minutes instead 
+ * of leaving a permanent offset. The ring is read by the I2C interrupt
+ * handler, entries are appended with interrupts disabled.
+ *
+ * Each read transaction starts with a snapshot of the header, and the 
+ * entries are served relative to it, so that a burst stays consistent
+ * when a minute is closed in the middle of it, wherever it starts. That
+ * close only ever overwrites the oldest entry of a full ring, which the
+ * burst has either already served or does not read.
+ */
+
+static uint8_t history_ring[HISTORY_MINUTES][2];
+static uint32_t history_head;       // next entry written
+static uint32_t history_count;
+static uint16_t history_base;       // see history.h
+static uint16_t history_last;       // reconstructed average of the newest entry
+static uint8_t history_seq;
+
+// Snapshot of the above for the reader, see history_begin()
+static uint32_t read_head;
+static uint32_t read_count;
+static uint16_t read_base;
+static uint8_t read_seq;
+
+// Current minute
+static uint32_t history_sum;
+static uint32_t history_samples;
+static uint16_t history_min;
+static uint16_t history_max;
+
+void history_add(uint16_t mv)
+{
+    if (history_samples == 0 || mv < history_min)
+        history_min = mv;
+    if (history_samples == 0 || mv > history_max)
+        history_max = mv;
+    history_sum += mv;
+    history_samples++;
+}
+
+static uint32_t spread(int32_t mv)
+{
+    if (mv <= 0)
+        return 0;
+    mv = (mv + HISTORY_SPREAD - 1) / HISTORY_SPREAD;
+    return mv > 15 ? 15 : mv;
+}
+
+void history_close(void)
+{
+    int32_t avg;
+    int32_t delta;
+    uint8_t *entry;
+
+    if (history_samples == 0)
+    {
+        // nothing measured, repeat the last average
+        history_min = history_max = history_last;
+        history_sum = history_last;
+        history_samples = 1;
+    }
+    avg = (history_sum + history_samples/2) / history_samples;
+    if (history_count == 0 && history_seq == 0)
+        history_base = history_last = avg;
+
+    delta = avg - history_last;
+    delta = (delta + (delta < 0 ? -HISTORY_STEP/2 : HISTORY_STEP/2)) / HISTORY_STEP;
+    if (delta > 127)
+        delta = 127;
+    if (delta < -127)
+        delta = -127;
+    history_last += delta*HISTORY_STEP;
+
+    __disable_irq();
+    entry = history_ring[history_head];
+    if (history_count == HISTORY_MINUTES)
+        history_base += (int8_t)entry[0] * HISTORY_STEP;    // oldest dropped
+    else
+        history_count++;
+    entry[0] = delta;
+    entry[1] = (spread(history_last - history_min) << 4) | spread(history_max - history_last);
+    history_head = (history_head + 1) % HISTORY_MINUTES;
+    history_seq++;
+    __enable_irq();
+
+    history_sum = 0;
+    history_samples = 0;
+}
+
+void history_begin(void)
+{
+    read_head = history_head;
+    read_count = history_count;
+    read_base = history_base;
+    read_seq = history_seq;
+}
+
+void history_read(uint32_t offset, uint8_t *data, uint32_t len)
+{
+    uint32_t i;
+
+    for (; len>0; offset++, len--)
+    {
+        switch (offset)
+        {
+            case 0:  *data++ = read_base; break;
+            case 1:  *data++ = read_base >> 8; break;
+            case 2:  *data++ = read_count; break;
+            case 3:  *data++ = read_seq; break;
+            default:
+                i = (offset - HISTORY_HEADER) / 2;
+                if (i >= read_count)
+                {
+                    *data++ = 0;    // not recorded in the snapshot
+                    break;
+                }
+                i = (read_head + HISTORY_MINUTES - read_count + i) % HISTORY_MINUTES;
+                *data++ = history_ring[i][(offset - HISTORY_HEADER) % 2];
+        }
+    }
+}
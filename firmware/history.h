@@ -0,0 +1,34 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+
+// Minutes kept, 4 hours
+#define HISTORY_MINUTES     240
+
+/* Layout of the history as read with history_read(), little endian:
+ *   0  BASE    average in mV of the minute before the oldest entry
+ *   2  COUNT   entries, up to HISTORY_MINUTES
+ *   3  SEQ     minutes recorded so far, wraps around
+ *   4  entries, oldest first, 2 bytes each:
+ *        int8  average minus the previous average, in HISTORY_STEP mV
+ *        uint8 average minus minimum (high nibble) and maximum minus 
+ *              average (low nibble), in HISTORY_SPREAD mV
+ */
+#define HISTORY_HEADER      4
+#define HISTORY_BYTES       (HISTORY_HEADER + 2*HISTORY_MINUTES)
+#define HISTORY_STEP        2
+#define HISTORY_SPREAD      8
+
+// Add a measurement to the current minute
+void history_add(uint16_t mv);
+
+// Close the current minute and append its entry
+void history_close(void);
+
+// Read callbacks for i2c_map(): history_begin() takes the snapshot of
+// the header that history_read() serves the transaction from
+void history_begin(void);
+void history_read(uint32_t offset, uint8_t *data, uint32_t len);
+
+#endif
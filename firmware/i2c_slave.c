@@ -1,26 +1,263 @@
 #include <stm32f0xx.h>
 #include "i2c_slave.h"
 #include "gpio.h"
+#include "event.h"
+#include "systick.h"
 
 /* SCL on PB8, AltFunc 1
  * SDA on PB9, AltFunc 1
  *
+ * Bytes written by the host (register pointer followed by data) are
+ * first stored in a staging buffer and committed to the writable ranges
+ * of the register buffer once the write ends (STOP or repeated
+ * START). 
+ *
+ * Reads are served from a snapshot of the register buffer rather than 
+ * from the buffer itself. Two images are kept: the main loop refreshes 
+ * the one not in use with i2c_publish() and swaps them, while the 
+ * interrupt handler latches the current one at address match and serves
+ * the whole transaction from it. The host thus never sees a value that 
+ * is half updated, or values taken at different times.
+ *
+ * The F030 has no SMBus support in I2C1, the optional PEC is computed
+ * in software with a CRC-8 table.
+ *
+ * The buffer sits at register address 0. Regions backed by providers, 
+ * either plain memory or read/write callbacks, can be mapped beyond it.
+ * They are reachable on a second address which takes 16-bit register 
+ * addresses.
+ *
+ * Bus errors drop the transfer in progress. A transfer which stops
+ * moving while SCL is low, e.g. after a glitch left the state machines
+ * of the host and the slave out of step, resets I2C1, so that the slave
+ * never holds the bus for more than the SMBus timeout (SysTick is only 
+ * running during transfers, the timebase is TIM14).
+ *
+ * With I2C_TRACE, the end of each transfer is recorded in a small ring,
+ * which the host can read back as a region.
+ *
+ * With I2C_SLAVE_DMA, the staging buffer is filled by DMA channel 3 and
+ * reads are streamed from the snapshot by DMA channel 2, so the
+ * interrupt handler only runs on ADDR and STOP instead of once per byte.
  */
 
+#define I2C_RX_BUF_SIZE 64
+
 uint8_t *i2c_buf;
-const uint8_t *i2c_mask;
-uint8_t i2c_buf_len;
+uint32_t i2c_buf_len;
 volatile uint32_t i2c_buf_rx_count;
 volatile uint32_t i2c_buf_tx_count;
 
 uint32_t i2c_op;
 uint32_t i2c_reg;
 
-#define I2C_OP_ADDR     0
+uint8_t *i2c_images;
+volatile uint32_t i2c_front;
+volatile int32_t i2c_latched = -1;
+volatile uint32_t i2c_commits;
+const uint8_t *i2c_tx_image;
+
+void (*i2c_write_handler)(uint32_t reg, uint32_t len);
+void (*i2c_read_handler)(uint32_t reg, uint32_t len, const uint8_t *image);
+
+// One bit per register byte changed by the host, see i2c_take_dirty()
+volatile uint32_t i2c_dirty[I2C_DIRTY_WORDS];
+
+// One bit per register byte the host may write, see i2c_set_writable()
+static uint32_t i2c_writable[I2C_DIRTY_WORDS];
+
+typedef struct {
+    uint32_t base;
+    uint32_t len;
+    const i2c_provider_t *provider;
+} i2c_region_t;
+
+static i2c_region_t i2c_regions[I2C_MAX_REGIONS];
+static uint32_t i2c_region_count;
+
+// Reads from callback providers go through here, a piece at a time
+#define I2C_BOUNCE_SIZE 16
+static uint8_t i2c_bounce[I2C_BOUNCE_SIZE];
+
+static uint8_t i2c_rx_buf[I2C_RX_BUF_SIZE];
+static uint32_t i2c_rx_len;     // bytes received in the current write
+static uint32_t i2c_tx_start;   // register of the first byte of the current read
+static uint32_t i2c_tx_written; // bytes written to TXDR in the current read
+static uint32_t i2c_tx_limit;   // bytes served from the registers before PEC/padding
+static uint32_t i2c_rx_overrun; // bytes dropped because the staging buffer is full
+#ifdef I2C_SLAVE_DMA
+static uint32_t i2c_tx_len;     // bytes programmed in the TX DMA channel
+#else
+static const uint8_t *i2c_tx_next; // next byte to serve
+static uint32_t i2c_tx_run;     // bytes left at i2c_tx_next
+#endif
+
+static uint8_t i2c_addr_w;      // matched address byte, write direction
+static uint8_t i2c_wide_addr_w; // address byte for 16-bit register addresses
+static uint8_t i2c_wide;        // current transaction uses 16-bit addresses
+static uint8_t i2c_pec_enabled;
+static uint8_t i2c_pec_header;  // pointer for the following read received
+static uint8_t i2c_pec_crc;     // CRC of the transaction so far
+static uint8_t i2c_pec_len;     // byte count requested in the header, 0 if none
+static uint8_t i2c_tx_pec;      // PEC appended to the current read
+volatile uint32_t i2c_pec_errors_count;
+volatile uint32_t i2c_errors[I2C_ERRORS];
+
+static uint32_t i2c_timing;     // TIMINGR of the speed profile
+static uint8_t i2c_own_addr_w;  // OAR1 address byte
+static uint32_t i2c_progress_mark;
+
+// CRC-8, polynomial x^8 + x^2 + x + 1, as used by SMBus
+static const uint8_t i2c_crc8_table[256] = {
+    0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+    0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+    0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65,
+    0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+    0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5,
+    0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+    0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85,
+    0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+    0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2,
+    0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+    0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2,
+    0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+    0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32,
+    0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+    0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42,
+    0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+    0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c,
+    0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+    0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec,
+    0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+    0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c,
+    0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+    0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c,
+    0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+    0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b,
+    0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+    0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b,
+    0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+    0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb,
+    0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+    0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb,
+    0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3,
+};
+
+static uint8_t i2c_crc8(uint8_t crc, const uint8_t *data, uint32_t len)
+{
+    while (len-- > 0)
+        crc = i2c_crc8_table[crc ^ *data++];
+    return crc;
+}
+
+/* TIMINGR for each speed profile, with the 48 MHz SYSCLK as I2C clock
+ * (RM0091, table 83). Only PRESC, SCLDEL and SDADEL matter in slave
+ * mode, SCLH and SCLL are kept from the table.
+ *      standard:  PRESC = 11, SCLDEL = 4, SDADEL = 2 -> setup 1250ns, hold 500ns
+ *      fast:      PRESC = 5,  SCLDEL = 3, SDADEL = 3 -> setup 500ns,  hold 375ns
+ *      fast plus: PRESC = 5,  SCLDEL = 1, SDADEL = 0 -> setup 250ns,  hold 0ns
+ */
+static const uint32_t i2c_timings[] = {
+    0xB0420F13U,
+    0x50330309U,
+    0x50100103U
+};
+
+#define I2C_OP_NONE     0
 #define I2C_OP_TX       1
 #define I2C_OP_RX       2
 
-void i2c_slave_init(uint8_t i2c_addr)
+#define I2C_DMA_TX      DMA1_Channel2
+#define I2C_DMA_RX      DMA1_Channel3
+
+#ifdef I2C_SLAVE_DMA
+static void i2c_dma_stop(void);
+#endif
+
+#ifdef I2C_TRACE
+
+static i2c_trace_t i2c_trace_ring[I2C_TRACE_ENTRIES];
+static uint32_t i2c_trace_count;
+
+static void i2c_trace(uint32_t flags, uint32_t reg, uint32_t len)
+{
+    i2c_trace_t *entry = &i2c_trace_ring[i2c_trace_count % I2C_TRACE_ENTRIES];
+
+    entry->time = systick_now();
+    entry->reg = reg;
+    entry->len = len>255 ? 255 : len;
+    entry->flags = flags;
+    i2c_trace_count++;
+}
+
+// Index in the ring of the nth oldest entry
+static inline uint32_t i2c_trace_index(uint32_t n)
+{
+    if (i2c_trace_count > I2C_TRACE_ENTRIES)
+        n += i2c_trace_count;
+    return n % I2C_TRACE_ENTRIES;
+}
+
+uint32_t i2c_trace_copy(i2c_trace_t *entries)
+{
+    uint32_t n;
+
+    __disable_irq();
+    n = i2c_trace_count<I2C_TRACE_ENTRIES ? i2c_trace_count : I2C_TRACE_ENTRIES;
+    for (uint32_t i=0; i<n; i++)
+        entries[i] = i2c_trace_ring[i2c_trace_index(i)];
+    __enable_irq();
+    return n;
+}
+
+// Called from the interrupt handler, which is also the only writer
+static void i2c_trace_read(uint32_t offset, uint8_t *data, uint32_t len)
+{
+    for (; len>0; offset++, len--)
+    {
+        if (offset < 4)
+            *data++ = i2c_trace_count >> (8*offset);
+        else
+            *data++ = ((const uint8_t *)&i2c_trace_ring[i2c_trace_index((offset-4)/sizeof(i2c_trace_t))])[(offset-4)%sizeof(i2c_trace_t)];
+    }
+}
+
+const i2c_provider_t i2c_trace_provider = { .read = i2c_trace_read };
+
+#else
+static inline void i2c_trace(uint32_t flags, uint32_t reg, uint32_t len) {}
+#endif
+
+// Set up I2C1, after power on or after a reset
+static void i2c_configure(void)
+{
+    I2C1->TIMINGR = i2c_timing;
+#ifdef I2C_SLAVE_DMA
+    I2C1->CR1 = I2C_CR1_ADDRIE      // -> Address match interrupt enable
+        | I2C_CR1_STOPIE            // -> Stop detection interrupt enable
+        | I2C_CR1_ERRIE             // -> Error interrupt enable
+        | I2C_CR1_TXDMAEN           // -> DMA requests for transmission
+        | I2C_CR1_RXDMAEN           // -> DMA requests for reception
+        ; // by default analog filter is enabled
+#else
+    I2C1->CR1 = I2C_CR1_RXIE    // -> Enable RECV interrupt enable
+        | I2C_CR1_ADDRIE        // -> Address match interrupt enable
+        | I2C_CR1_STOPIE        // -> Stop detection interrupt enable
+        | I2C_CR1_ERRIE         // -> Error interrupt enable
+        //| I2C_CR1_NOSTRETCH     // -> Dissable SCL slave stretch
+        ; // by default analog filter is enabled
+#endif
+
+    // Set i2c_addr and enable it.
+    I2C1->OAR1 = i2c_own_addr_w;
+    I2C1->OAR1 |= I2C_OAR1_OA1EN;
+    if (i2c_wide_addr_w)
+        I2C1->OAR2 = i2c_wide_addr_w | I2C_OAR2_OA2EN;
+
+    I2C1->CR1 |= I2C_CR1_PE; // I2C enable
+}
+
+void i2c_slave_init(uint8_t i2c_addr, uint32_t speed)
 {
     gpio_enable_port_clock(PORTB);
 
@@ -40,47 +277,241 @@ void i2c_slave_init(uint8_t i2c_addr)
     gpio_config_output_type(GPIO_I2C_SDA, GPIO_OPEN_DRAIN);
     gpio_enable_alternate_function(GPIO_I2C_SDA, 1);
 
-    // Enable peripheral clock for I2C1
+    if (speed > I2C_SPEED_FAST_PLUS)
+        speed = I2C_SPEED_FAST_PLUS;
+
+    // 20 mA drive needed to meet the Fm+ rise and fall times
+    if (speed == I2C_SPEED_FAST_PLUS)
+    {
+        RCC->APB2ENR |= RCC_APB2ENR_SYSCFGEN;
+        SYSCFG->CFGR1 |= SYSCFG_CFGR1_I2C_FMP_PB8 | SYSCFG_CFGR1_I2C_FMP_PB9;
+    }
+
+    // Enable peripheral clock for I2C1, clocked by SYSCLK rather than 
+    // HSI for a finer timing resolution
     RCC->APB1ENR |= RCC_APB1ENR_I2C1EN;
-    // TODO: what about setting sys clock as source for i2c clock ?
-    // RCC->CFGR3 |= RCC_CFGR3_I2C1SW;
-
-    // I2C time reg:
-    // 0x2010 091A -> 
-    //      PREDC = 2
-    //      SCLDEL = 1
-    //      SDADEL = 0
-    //      rest is ignored in slave mode.
-    I2C1->TIMINGR = 0x2010091AU;
-    I2C1->CR1 = I2C_CR1_RXIE    // -> Enable RECV interrupt enable
-        | I2C_CR1_ADDRIE        // -> Address match interrupt enable
-        | I2C_CR1_STOPIE        // -> Stop detection interrupt enable
-        //| I2C_CR1_NOSTRETCH     // -> Dissable SCL slave stretch
-        ; // by default analog filter is enabled
+    RCC->CFGR3 |= RCC_CFGR3_I2C1SW;
 
-    // Set i2c_addr and enable it.
-    I2C1->OAR1 |= ((int32_t)i2c_addr)<<1;
-    I2C1->OAR1 |= I2C_OAR1_OA1EN;
+    i2c_timing = i2c_timings[speed];
+    i2c_own_addr_w = i2c_addr<<1;
+#ifdef I2C_SLAVE_DMA
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
 
-    I2C1->CR1 |= I2C_CR1_PE; // I2C enable
+    // Channel 2: memory -> TXDR, channel 3: RXDR -> memory.
+    // Both interrupt on transfer complete, i.e. when the host goes
+    // past the end of the buffer, to fall back on per-byte interrupts.
+    I2C_DMA_TX->CPAR = (uint32_t)&(I2C1->TXDR);
+    I2C_DMA_TX->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_TCIE | DMA_CCR_PL_1;
+    I2C_DMA_RX->CPAR = (uint32_t)&(I2C1->RXDR);
+    I2C_DMA_RX->CMAR = (uint32_t)i2c_rx_buf;
+    I2C_DMA_RX->CCR = DMA_CCR_MINC | DMA_CCR_TCIE | DMA_CCR_PL_1;
+
+    NVIC_SetPriority(DMA1_Channel2_3_IRQn, 0);
+    NVIC_EnableIRQ(DMA1_Channel2_3_IRQn);
+#endif
 
+    i2c_configure();
 
-    i2c_set_buffer(0, 0, 0);
+    i2c_set_buffer(0, 0);
+    i2c_set_writable(0, 0);
 
     i2c_reg = 0;
-    i2c_op = I2C_OP_ADDR;
+    i2c_op = I2C_OP_NONE;
 
     NVIC_SetPriority(I2C1_IRQn, 0); // Set max priority
     NVIC_EnableIRQ(I2C1_IRQn);      // Enable IRQ
+
+    // Same priority as I2C1: the timeout never preempts the handler
+    NVIC_SetPriority(SysTick_IRQn, 0);
 }
 
-void i2c_set_buffer(uint8_t *buf, const uint8_t *mask, uint32_t len)
+void i2c_set_buffer(uint8_t *buf, uint32_t len)
 {
     i2c_buf = buf;
-    i2c_mask = mask;
     i2c_buf_len = len;
 }
 
+void i2c_set_writable(const i2c_range_t *ranges, uint32_t count)
+{
+    uint32_t reg, end;
+
+    for (uint32_t i=0; i<I2C_DIRTY_WORDS; i++)
+        i2c_writable[i] = 0;
+    for (; count>0; ranges++, count--)
+    {
+        end = ranges->start + ranges->len;
+        for (reg=ranges->start; reg<end && (reg>>5)<I2C_DIRTY_WORDS; reg++)
+            i2c_writable[reg>>5] |= 1<<(reg&31);
+    }
+}
+
+void i2c_enable_wide_address(uint8_t i2c_addr)
+{
+    i2c_wide_addr_w = i2c_addr<<1;
+    I2C1->OAR2 = i2c_wide_addr_w | I2C_OAR2_OA2EN;
+}
+
+int i2c_map(uint32_t base, uint32_t len, const i2c_provider_t *provider)
+{
+    i2c_region_t *region = &i2c_regions[i2c_region_count];
+
+    if (i2c_region_count >= I2C_MAX_REGIONS)
+        return -1;
+
+    region->base = base;
+    region->len = len;
+    region->provider = provider;
+    i2c_region_count++;
+    return 0;
+}
+
+static const i2c_region_t *i2c_find_region(uint32_t reg)
+{
+    for (uint32_t i=0; i<i2c_region_count; i++)
+    {
+        if (reg >= i2c_regions[i].base && reg-i2c_regions[i].base < i2c_regions[i].len)
+            return &i2c_regions[i];
+    }
+    return 0;
+}
+
+// Number of registers mapped without a gap from reg on
+static uint32_t i2c_mapped(uint32_t reg)
+{
+    const i2c_region_t *region;
+    uint32_t n = reg<i2c_buf_len ? i2c_buf_len-reg : 0;
+
+    while ((region = i2c_find_region(reg+n)) != 0)
+        n = region->base + region->len - reg;
+    return n;
+}
+
+// Memory to read register reg from, and the number of bytes that follow
+// it there. Returns 0 if reg is not mapped.
+static const uint8_t *i2c_tx_ptr(uint32_t reg, uint32_t *run)
+{
+    const i2c_region_t *region;
+    const i2c_provider_t *provider;
+
+    if (reg<i2c_buf_len)
+    {
+        *run = i2c_buf_len-reg;
+        return i2c_tx_image + reg;
+    }
+    region = i2c_find_region(reg);
+    if (region == 0)
+        return 0;
+    provider = region->provider;
+    reg -= region->base;
+    *run = region->len - reg;
+    if (provider->buf)
+        return provider->buf + reg;
+
+    if (*run > I2C_BOUNCE_SIZE)
+        *run = I2C_BOUNCE_SIZE;
+    provider->read(reg, i2c_bounce, *run);
+    return i2c_bounce;
+}
+
+void i2c_set_write_handler(void (*handler)(uint32_t reg, uint32_t len))
+{
+    i2c_write_handler = handler;
+}
+
+void i2c_take_dirty(uint32_t *dirty)
+{
+    __disable_irq();
+    for (uint32_t i=0; i<I2C_DIRTY_WORDS; i++)
+    {
+        dirty[i] = i2c_dirty[i];
+        i2c_dirty[i] = 0;
+    }
+    __enable_irq();
+}
+
+void i2c_set_read_handler(void (*handler)(uint32_t reg, uint32_t len, const uint8_t *image))
+{
+    i2c_read_handler = handler;
+}
+
+void i2c_set_images(uint8_t *images)
+{
+    i2c_images = images;
+    i2c_front = 0;
+}
+
+int i2c_publish(void)
+{
+    uint32_t back = i2c_front ^ 1;
+    uint8_t *image;
+    uint32_t commits;
+
+    if (i2c_images == 0)
+        return 0;
+
+    // The host is still reading the previous snapshot
+    if (i2c_latched == back)
+        return -1;
+
+    image = i2c_images + back*i2c_buf_len;
+    do 
+    {
+        // start again if the host wrote registers while we copied them
+        commits = i2c_commits;
+        for (uint32_t i=0; i<i2c_buf_len; i++)
+            image[i] = i2c_buf[i];
+    } while (commits != i2c_commits);
+
+    i2c_front = back;
+    return 0;
+}
+
+void i2c_touch(void)
+{
+    __disable_irq();
+    i2c_commits++;
+    __enable_irq();
+}
+
+// Raised whatever the end of the read, so that the main loop retries an 
+// i2c_publish() that found the image latched
+static inline void i2c_release_image(void)
+{
+    if (i2c_latched >= 0)
+    {
+        i2c_latched = -1;
+        event_raise(EVENT_I2C_RELEASE);
+    }
+}
+
+static inline void i2c_latch_image(void)
+{
+    if (i2c_images)
+    {
+        i2c_latched = i2c_front;
+        i2c_tx_image = i2c_images + i2c_latched*i2c_buf_len;
+    }
+    else
+    {
+        i2c_tx_image = i2c_buf;
+    }
+}
+
+void i2c_enable_pec(int enable)
+{
+    i2c_pec_enabled = enable!=0;
+}
+
+uint32_t i2c_pec_errors(void)
+{
+    return i2c_pec_errors_count;
+}
+
+uint32_t i2c_error_count(uint32_t error)
+{
+    return error<I2C_ERRORS ? i2c_errors[error] : 0;
+}
+
 uint32_t i2c_rx_count(void)
 {
     return i2c_buf_rx_count;
@@ -91,62 +522,524 @@ uint32_t i2c_tx_count(void)
     return i2c_buf_tx_count;
 }
 
+// With PEC, check the write and strip the PEC byte. Returns the number
+// of bytes to apply, 0 if the write is only a pointer for a read or is
+// rejected.
+static uint32_t i2c_rx_check(uint32_t len, uint32_t stop)
+{
+    uint8_t crc = i2c_crc8(i2c_crc8(0, &i2c_addr_w, 1), i2c_rx_buf, len);
+    uint32_t ptr_len = i2c_wide ? 2 : 1;
+
+    if (!stop)
+    {
+        // The PEC comes at the end of the read and covers these bytes
+        if (len<ptr_len)
+            return 0;
+        i2c_reg = i2c_wide ? (i2c_rx_buf[0]<<8) | i2c_rx_buf[1] : i2c_rx_buf[0];
+        i2c_pec_len = len>ptr_len ? i2c_rx_buf[ptr_len] : 0;
+        i2c_pec_crc = crc;
+        i2c_pec_header = 1;
+        i2c_trace(I2C_TRACE_RESTART, i2c_reg, 0);
+        return 0;
+    }
+
+    // The CRC of a frame followed by its PEC is 0
+    if (len<2 || crc!=0 || i2c_rx_overrun)
+    {
+        i2c_pec_errors_count++;
+        i2c_trace(I2C_TRACE_PEC, i2c_rx_buf[0], len);
+        event_raise(EVENT_I2C_ERROR);
+        return 0;
+    }
+    return len-1;
+}
+
+// Write a byte from the host to a mapped region, through its provider.
+// Returns -1 if reg is not mapped.
+static int i2c_region_write(uint32_t reg, uint8_t data)
+{
+    const i2c_region_t *region = i2c_find_region(reg);
+    const i2c_provider_t *provider;
+    uint8_t *buf;
+    uint8_t mask;
+
+    if (region == 0)
+        return -1;
+    provider = region->provider;
+    reg -= region->base;
+    if (provider->buf && provider->mask)
+    {
+        // memory with a write mask is necessarily in RAM
+        buf = (uint8_t *)provider->buf;
+        mask = provider->mask[reg];
+        buf[reg] = (buf[reg] & ~mask) | (data & mask);
+    }
+    else if (provider->buf == 0 && provider->write)
+    {
+        provider->write(reg, data);
+    }
+    return 0;
+}
+
+// Apply a write from the host: the first byte, or two bytes on the wide
+// address, is the register pointer, the following ones are data, 
+// only applied to the writable ranges of the buffer. 
+// The current image is updated too, so that the host reads back what it
+// wrote before the next i2c_publish().
+static void i2c_rx_end(uint32_t stop)
+{
+    uint8_t *image = i2c_images ? i2c_images + i2c_front*i2c_buf_len : 0;
+    uint8_t data;
+    uint32_t start;
+    uint32_t len = i2c_rx_len;
+    uint32_t i = i2c_wide ? 2 : 1;
+
+    i2c_rx_len = 0;
+    if (i2c_pec_enabled && len>0)
+        len = i2c_rx_check(len, stop);
+    else if (len < i)
+        i2c_trace(stop ? I2C_TRACE_STOP : I2C_TRACE_RESTART, i2c_reg, 0);
+    if (len < i)
+        return;
+
+    start = i2c_reg = i2c_wide ? (i2c_rx_buf[0]<<8) | i2c_rx_buf[1] : i2c_rx_buf[0];
+    for (; i<len; i++, i2c_reg++)
+    {
+        if (i2c_reg >= i2c_buf_len)
+        {
+            if (i2c_region_write(i2c_reg, i2c_rx_buf[i]) < 0)
+                break;
+            continue;
+        }
+
+        // read-only bytes, and all those beyond the bitmap, are skipped
+        if ((i2c_reg>>5) >= I2C_DIRTY_WORDS || ((i2c_writable[i2c_reg>>5] >> (i2c_reg&31)) & 1) == 0)
+            continue;
+
+        data = i2c_rx_buf[i];
+        if (data != i2c_buf[i2c_reg])
+            i2c_dirty[i2c_reg>>5] |= 1<<(i2c_reg&31);
+        i2c_buf[i2c_reg] = data;
+        if (image)
+            image[i2c_reg] = data;
+    }
+
+    i2c_trace(stop ? I2C_TRACE_STOP : I2C_TRACE_RESTART, start, i2c_reg-start);
+
+    if (i2c_write_handler && i2c_reg>start)
+        i2c_write_handler(start, i2c_reg-start);
+
+    i2c_commits++;
+    i2c_buf_rx_count++;
+    event_raise(EVENT_I2C_RX);
+}
+
+static void i2c_tx_begin(void)
+{
+    i2c_latch_image();
+    i2c_tx_start = i2c_reg;
+    i2c_tx_written = 0;
+#ifndef I2C_SLAVE_DMA
+    i2c_tx_run = 0;
+#endif
+
+    // Serve the buffer and the regions that follow it without a gap
+    i2c_tx_limit = i2c_mapped(i2c_tx_start);
+    for (uint32_t i=0; i<i2c_region_count; i++)
+    {
+        const i2c_region_t *region = &i2c_regions[i];
+
+        if (region->provider->begin && region->base + region->len > i2c_tx_start
+            && region->base < i2c_tx_start + i2c_tx_limit)
+            region->provider->begin();
+    }
+
+    if (i2c_pec_enabled)
+    {
+        uint8_t addr_r = i2c_addr_w | 1;
+        uint8_t crc = i2c_pec_header ? i2c_pec_crc : 0;
+        const uint8_t *data;
+        uint32_t run;
+
+        if (i2c_pec_header && i2c_pec_len>0 && i2c_pec_len<i2c_tx_limit)
+            i2c_tx_limit = i2c_pec_len;
+        crc = i2c_crc8(crc, &addr_r, 1);
+        for (uint32_t n=0; n<i2c_tx_limit; n+=run)
+        {
+            data = i2c_tx_ptr(i2c_tx_start + n, &run);
+            if (run > i2c_tx_limit-n)
+                run = i2c_tx_limit-n;
+            crc = i2c_crc8(crc, data, run);
+        }
+        i2c_tx_pec = crc;
+        i2c_pec_header = 0;
+    }
+}
+
+// Byte to send once the image has been served: PEC then padding
+static inline uint8_t i2c_tx_trailer(void)
+{
+    if (i2c_pec_enabled && i2c_tx_written == i2c_tx_limit)
+        return i2c_tx_pec;
+    return 0xee;
+}
+
+// End of a read: work out how many bytes actually reached the host
+static void i2c_tx_end(uint32_t stop)
+{
+    uint32_t sent = i2c_tx_written;
+    uint32_t nack = I2C1->ISR & I2C_ISR_NACKF;
+
+    I2C1->ICR = I2C_ICR_NACKCF;
+
+    // The byte prefetched in TXDR after the host's NACK was never sent
+    if (sent>0 && (I2C1->ISR & I2C_ISR_TXE) == 0)
+        sent--;
+    // Neither is the PEC a register
+    if (i2c_pec_enabled && sent>i2c_tx_limit)
+        sent = i2c_tx_limit;
+
+    i2c_reg = i2c_tx_start + sent;
+    i2c_release_image();
+
+    i2c_trace(I2C_TRACE_READ | (nack ? I2C_TRACE_NACK : stop ? I2C_TRACE_STOP : I2C_TRACE_RESTART), 
+        i2c_tx_start, sent);
+
+    if (sent == 0)
+        return;
+
+    // Only the buffer has a snapshot to hand over
+    if (i2c_read_handler && i2c_tx_start<i2c_buf_len)
+    {
+        if (sent > i2c_buf_len-i2c_tx_start)
+            sent = i2c_buf_len-i2c_tx_start;
+        i2c_read_handler(i2c_tx_start, sent, i2c_tx_image);
+        i2c_commits++;
+    }
+
+    i2c_buf_tx_count++;
+    event_raise(EVENT_I2C_TX);
+}
+
+// End of the current transfer, by a STOP or a repeated START
+static void i2c_end(uint32_t stop)
+{
+    if (i2c_op == I2C_OP_RX)
+        i2c_rx_end(stop);
+    if (i2c_op == I2C_OP_TX)
+        i2c_tx_end(stop);
+    i2c_op = I2C_OP_NONE;
+    if (stop)
+        i2c_pec_header = 0;
+}
+
+// Bytes moved so far in the current transfer, only ever goes up
+static uint32_t i2c_progress(void)
+{
+    uint32_t n = i2c_rx_len + i2c_rx_overrun + i2c_tx_written;
+
+#ifdef I2C_SLAVE_DMA
+    if ((I2C_DMA_RX->CCR & DMA_CCR_EN) != 0)
+        n += I2C_RX_BUF_SIZE - I2C_DMA_RX->CNDTR;
+    if ((I2C_DMA_TX->CCR & DMA_CCR_EN) != 0)
+        n += i2c_tx_len - I2C_DMA_TX->CNDTR;
+#endif
+    return n;
+}
+
+// Watch the transfer from address match to STOP
+static void i2c_timeout_start(void)
+{
+    i2c_progress_mark = i2c_progress();
+    SysTick->LOAD = SystemCoreClock/1000*I2C_TIMEOUT_MS - 1;
+    SysTick->VAL = 0;
+    SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_TICKINT_Msk | SysTick_CTRL_ENABLE_Msk;
+}
+
+static void i2c_timeout_stop(void)
+{
+    SysTick->CTRL = 0;
+}
+
+// Drop the current transfer, nothing is applied or reported
+static void i2c_abort(uint32_t reason)
+{
+    if (i2c_op == I2C_OP_TX)
+        i2c_trace(I2C_TRACE_READ | reason, i2c_tx_start, i2c_progress());
+    else
+        i2c_trace(reason, i2c_reg, i2c_progress());
+
+#ifdef I2C_SLAVE_DMA
+    i2c_dma_stop();
+#else
+    I2C1->CR1 &= ~I2C_CR1_TXIE;
+#endif
+    i2c_rx_len = 0;
+    i2c_release_image();
+    i2c_op = I2C_OP_NONE;
+    i2c_pec_header = 0;
+    i2c_timeout_stop();
+}
+
+static void i2c_error(uint32_t status)
+{
+    if ((status & I2C_ISR_BERR) != 0)
+        i2c_errors[I2C_ERROR_BUS]++;
+    if ((status & I2C_ISR_ARLO) != 0)
+        i2c_errors[I2C_ERROR_ARBITRATION]++;
+    if ((status & I2C_ISR_OVR) != 0)
+        i2c_errors[I2C_ERROR_OVERRUN]++;
+    I2C1->ICR = I2C_ICR_BERRCF | I2C_ICR_ARLOCF | I2C_ICR_OVRCF;
+
+    i2c_abort(I2C_TRACE_ERROR);
+    event_raise(EVENT_I2C_ERROR);
+}
+
+void SysTick_Handler(void)
+{
+    uint32_t progress = i2c_progress();
+
+    if (progress != i2c_progress_mark || gpio_read(GPIO_I2C_SCL))
+    {
+        i2c_progress_mark = progress;
+        return;
+    }
+
+    // Stuck with SCL low: reset I2C1, which releases SCL and SDA
+    i2c_abort(I2C_TRACE_TIMEOUT);
+    RCC->APB1RSTR |= RCC_APB1RSTR_I2C1RST;
+    RCC->APB1RSTR &= ~RCC_APB1RSTR_I2C1RST;
+    i2c_configure();
+
+    i2c_errors[I2C_ERROR_TIMEOUT]++;
+    event_raise(EVENT_I2C_ERROR);
+}
+
+#ifdef I2C_SLAVE_DMA
+
+static void i2c_dma_rx_start(void)
+{
+    I2C_DMA_RX->CCR &= ~DMA_CCR_EN;
+    DMA1->IFCR = DMA_IFCR_CGIF3;
+    i2c_rx_overrun = 0;
+    I2C_DMA_RX->CNDTR = I2C_RX_BUF_SIZE;
+    I2C_DMA_RX->CCR |= DMA_CCR_EN;
+}
+
+// Stream the next contiguous piece of the registers: the rest of the
+// buffer or of a region
+static void i2c_dma_tx_next(void)
+{
+    const uint8_t *data = 0;
+    uint32_t run;
+
+    if (i2c_tx_written<i2c_tx_limit)
+        data = i2c_tx_ptr(i2c_tx_start + i2c_tx_written, &run);
+    if (data)
+    {
+        if (run > i2c_tx_limit-i2c_tx_written)
+            run = i2c_tx_limit-i2c_tx_written;
+        i2c_tx_len = run;
+        I2C_DMA_TX->CMAR = (uint32_t)data;
+        I2C_DMA_TX->CNDTR = i2c_tx_len;
+        I2C_DMA_TX->CCR |= DMA_CCR_EN;
+    }
+    else
+    {
+        // Nothing left to stream, send PEC and padding from the TXIS interrupt
+        i2c_tx_len = 0;
+        I2C1->CR1 |= I2C_CR1_TXIE;
+    }
+}
+
+static void i2c_dma_tx_start(void)
+{
+    I2C_DMA_TX->CCR &= ~DMA_CCR_EN;
+    DMA1->IFCR = DMA_IFCR_CGIF2;
+    i2c_dma_tx_next();
+}
+
+// Stop both channels and account for what they transferred
+static void i2c_dma_stop(void)
+{
+    I2C1->CR1 &= ~(I2C_CR1_TXIE | I2C_CR1_RXIE);
+
+    if ((I2C_DMA_TX->CCR & DMA_CCR_EN) != 0)
+    {
+        I2C_DMA_TX->CCR &= ~DMA_CCR_EN;
+        i2c_tx_written += i2c_tx_len - I2C_DMA_TX->CNDTR;
+        i2c_tx_len = 0;
+    }
+    if ((I2C_DMA_RX->CCR & DMA_CCR_EN) != 0)
+    {
+        I2C_DMA_RX->CCR &= ~DMA_CCR_EN;
+        i2c_rx_len = I2C_RX_BUF_SIZE - I2C_DMA_RX->CNDTR;
+    }
+}
+
+void DMA1_Channel2_3_IRQHandler(void)
+{
+    uint32_t dma_status = DMA1->ISR;
+
+    if ((dma_status & DMA_ISR_TCIF2) != 0)
+    {
+        // Host reads past the end of the piece, go on with the next one
+        // or with PEC and padding
+        DMA1->IFCR = DMA_IFCR_CGIF2;
+        I2C_DMA_TX->CCR &= ~DMA_CCR_EN;
+        i2c_tx_written += i2c_tx_len;
+        i2c_dma_tx_next();
+    }
+    if ((dma_status & DMA_ISR_TCIF3) != 0)
+    {
+        // Staging buffer is full, drop the rest
+        DMA1->IFCR = DMA_IFCR_CGIF3;
+        I2C1->CR1 |= I2C_CR1_RXIE;
+    }
+}
+
+void I2C1_IRQHandler(void)
+{
+    uint32_t I2C_InterruptStatus = I2C1->ISR; /* Get interrupt status */
+    uint8_t dummy;
+
+    if ((I2C_InterruptStatus & (I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR)) != 0)
+        i2c_error(I2C_InterruptStatus);
+
+    if ((I2C_InterruptStatus & I2C_ISR_ADDR) == I2C_ISR_ADDR)
+    {
+        // A repeated START ends the previous transfer
+        i2c_dma_stop();
+        i2c_end(0);
+
+        // Which of our two addresses the host is talking to
+        i2c_addr_w = (I2C_InterruptStatus & I2C_ISR_ADDCODE) >> 16;
+        i2c_wide = i2c_wide_addr_w!=0 && i2c_addr_w==i2c_wide_addr_w;
+
+        if((I2C_InterruptStatus & I2C_ISR_DIR) == I2C_ISR_DIR) /* Check if transfer direction is read (slave transmitter) */
+        {
+            I2C1->ISR |= I2C_ISR_TXE;  /* flush any data in TXDR */
+            i2c_tx_begin();
+            i2c_dma_tx_start();
+            i2c_op = I2C_OP_TX;
+        }
+        else
+        {
+            i2c_dma_rx_start();
+            i2c_op = I2C_OP_RX;
+        }
+
+        i2c_timeout_start();
+
+        // Writing I2C_ICR_ADDRCF clears interrupt flag and releases SCL
+        I2C1->ICR = I2C_ICR_ADDRCF; /* Address match event */
+    }
+    else if ((I2C_InterruptStatus & I2C_ISR_RXNE) == I2C_ISR_RXNE)
+    {
+        // Only enabled once the staging buffer is full
+        dummy = I2C1->RXDR;
+        (void)dummy;
+        i2c_rx_overrun++;
+    }
+    else if ((I2C_InterruptStatus & I2C_ISR_TXIS) == I2C_ISR_TXIS)
+    {
+        // Only enabled once the host has read all the registers
+        I2C1->TXDR = i2c_tx_trailer();
+        i2c_tx_written++;
+    }
+    else if ((I2C_InterruptStatus & I2C_ISR_STOPF) == I2C_ISR_STOPF)
+    {
+        // Writing I2C_ICR_STOPCF clears interrupt flag
+        I2C1->ICR = I2C_ICR_STOPCF;
+
+        i2c_dma_stop();
+        i2c_end(1);
+        // NACKF is traced by i2c_tx_end() first
+        I2C1->ICR = I2C_ICR_NACKCF;
+        i2c_timeout_stop();
+    }
+}
+
+#else
+
 void I2C1_IRQHandler(void)
 {
     // See page 669 in RM0091 reference manual for interrup clear/set conditions
     uint32_t I2C_InterruptStatus = I2C1->ISR; /* Get interrupt status */
     uint8_t dummy;
 
+    if ((I2C_InterruptStatus & (I2C_ISR_BERR | I2C_ISR_ARLO | I2C_ISR_OVR)) != 0)
+        i2c_error(I2C_InterruptStatus);
+
     if ((I2C_InterruptStatus & I2C_ISR_ADDR) == I2C_ISR_ADDR)
     {
-        // Writing I2C_ICR_ADDRCF clears interrupt flag
-        I2C1->ICR |= I2C_ICR_ADDRCF; /* Address match event */
+        // A repeated START ends the previous transfer
+        I2C1->CR1 &= ~I2C_CR1_TXIE;
+        i2c_end(0);
+
+        // Which of our two addresses the host is talking to
+        i2c_addr_w = (I2C_InterruptStatus & I2C_ISR_ADDCODE) >> 16;
+        i2c_wide = i2c_wide_addr_w!=0 && i2c_addr_w==i2c_wide_addr_w;
 
-        if((I2C1->ISR & I2C_ISR_DIR) == I2C_ISR_DIR) /* Check if transfer direction is read (slave transmitter) */
+        if((I2C_InterruptStatus & I2C_ISR_DIR) == I2C_ISR_DIR) /* Check if transfer direction is read (slave transmitter) */
         {
             I2C1->ISR |= I2C_ISR_TXE;  /* flush any data in TXDR */
+            i2c_tx_begin();
             I2C1->CR1 |= I2C_CR1_TXIE; /* Set transmit IT */
+            i2c_op = I2C_OP_TX;
         }
-        i2c_op = I2C_OP_ADDR;
+        else
+        {
+            i2c_rx_overrun = 0;
+            i2c_op = I2C_OP_RX;
+        }
+
+        i2c_timeout_start();
+
+        // Writing I2C_ICR_ADDRCF clears interrupt flag
+        I2C1->ICR = I2C_ICR_ADDRCF; /* Address match event */
     }
     else if ((I2C_InterruptStatus & I2C_ISR_RXNE) == I2C_ISR_RXNE)
     {
         // Slave is receiving data
         // Reading RXDR clears interrupt
 
-        if (i2c_op == I2C_OP_ADDR)
+        if (i2c_rx_len<I2C_RX_BUF_SIZE)
         {
-            i2c_reg = (I2C1->RXDR)&0xFF;
+            i2c_rx_buf[i2c_rx_len++] = I2C1->RXDR;
         }
         else
         {
-            if (i2c_reg<i2c_buf_len) {
-                i2c_buf[i2c_reg] &= ~i2c_mask[i2c_reg];
-                i2c_buf[i2c_reg] |= (I2C1->RXDR)&i2c_mask[i2c_reg];
-                i2c_reg++;
-            } else {
-                dummy = I2C1->RXDR;
-            }
+            dummy = I2C1->RXDR;
+            i2c_rx_overrun++;
         }
-        i2c_op = I2C_OP_RX;
+        (void)dummy;
     }
     else if ((I2C_InterruptStatus & I2C_ISR_TXIS) == I2C_ISR_TXIS)
     {
         // Slave is transmitting data
-
-        if (i2c_reg<i2c_buf_len)
-            I2C1->TXDR = i2c_buf[i2c_reg++];
+        if (i2c_tx_written<i2c_tx_limit)
+        {
+            if (i2c_tx_run == 0)
+                i2c_tx_next = i2c_tx_ptr(i2c_tx_start + i2c_tx_written, &i2c_tx_run);
+            I2C1->TXDR = *i2c_tx_next++;
+            i2c_tx_run--;
+        }
         else
-            I2C1->TXDR = 0xee;
-        i2c_op = I2C_OP_TX;
+            I2C1->TXDR = i2c_tx_trailer();
+        i2c_tx_written++;
     }
     else if ((I2C_InterruptStatus & I2C_ISR_STOPF) == I2C_ISR_STOPF)
     {
         // Writing I2C_ICR_STOPCF clears interrupt flag
-        I2C1->ICR |= I2C_ICR_STOPCF;
-        if (i2c_op == I2C_OP_TX)
-            i2c_buf_tx_count++;
-        if (i2c_op == I2C_OP_RX)
-            i2c_buf_rx_count++;
+        I2C1->ICR = I2C_ICR_STOPCF;
+        I2C1->CR1 &= ~I2C_CR1_TXIE;
+
+        i2c_end(1);
+        // NACKF is traced by i2c_tx_end() first
+        I2C1->ICR = I2C_ICR_NACKCF;
+        i2c_timeout_stop();
     }
 }
+
+#endif
@@ -1,9 +1,137 @@
 #ifndef _I2C_SLAVE_H_
 #define _I2C_SLAVE_H_
 
-void i2c_slave_init(uint8_t i2c_addr);
+// Bus speed profiles, they set the data setup and hold times
+#define I2C_SPEED_STANDARD  0   // 100 kHz
+#define I2C_SPEED_FAST      1   // 400 kHz
+#define I2C_SPEED_FAST_PLUS 2   // 1 MHz, with Fm+ drive on SCL and SDA
 
-void i2c_set_buffer(uint8_t *buf, const uint8_t *mask, uint32_t len);
+void i2c_slave_init(uint8_t i2c_addr, uint32_t speed);
+
+void i2c_set_buffer(uint8_t *buf, uint32_t len);
+
+// Bytes of the buffer the host may write, the rest is read-only
+typedef struct {
+    uint8_t start;
+    uint8_t len;
+} i2c_range_t;
+
+// Set the writable ranges of the buffer. They are turned into a bitmap,
+// one bit per byte like the one of i2c_take_dirty(), so only the first
+// 32*I2C_DIRTY_WORDS bytes can be writable.
+void i2c_set_writable(const i2c_range_t *ranges, uint32_t count);
+
+// Second address on which the host sends 16-bit register addresses,
+// most significant byte first, to reach the regions mapped with 
+// i2c_map() as well as the buffer. Reads go on across adjacent regions.
+void i2c_enable_wide_address(uint8_t i2c_addr);
+
+#define I2C_MAX_REGIONS 8
+
+// Backing store of a region of the register space. Either memory read
+// and written directly (buf), or callbacks, run in the interrupt 
+// handler, which must return the same data throughout a transaction.
+typedef struct {
+    const uint8_t *buf;     // memory behind the region, or 0
+    const uint8_t *mask;    // write mask over buf, 0 if read-only
+    // fill data with len bytes starting at offset in the region
+    void (*read)(uint32_t offset, uint8_t *data, uint32_t len);
+    // write one byte at offset in the region, 0 if read-only
+    void (*write)(uint32_t offset, uint8_t data);
+    // start of a read transaction that may reach the region, before
+    // any read, 0 if not needed
+    void (*begin)(void);
+} i2c_provider_t;
+
+// Map len bytes at register address base, beyond the buffer, to a 
+// provider. Unlike the buffer, regions are read live, without a snapshot
+// unless the provider takes one in begin.
+// Returns -1 if there is no free region.
+int i2c_map(uint32_t base, uint32_t len, const i2c_provider_t *provider);
+
+// Called from the interrupt handler once a write of len bytes starting
+// at register reg has been applied to the buffer.
+void i2c_set_write_handler(void (*handler)(uint32_t reg, uint32_t len));
+
+// Called from the interrupt handler once the host has read len bytes 
+// starting at register reg, out of the snapshot image.
+void i2c_set_read_handler(void (*handler)(uint32_t reg, uint32_t len, const uint8_t *image));
+
+// Number of 32-bit words in the dirty bitmap, i.e. 128 register bytes
+#define I2C_DIRTY_WORDS 4
+
+// Copy and clear the bitmap of register bytes changed by the host
+// since the last call. Bit n of word w stands for register 32*w+n.
+void i2c_take_dirty(uint32_t *dirty);
+
+// Two consecutive images of len bytes, from which reads are served 
+void i2c_set_images(uint8_t *images);
+
+// Copy the buffer to the image not in use and make it current.
+// Returns -1 if the host is still reading that image, try again on
+// EVENT_I2C_RELEASE.
+int i2c_publish(void);
+
+// Make a pending i2c_publish() start its copy again, for changes made to
+// the buffer by an interrupt handler that can preempt it.
+void i2c_touch(void);
+
+// SMBus Packet Error Checking. When enabled:
+// - writes end with a PEC byte and are only applied, as a whole, if it
+//   matches. They must end with a STOP.
+// - the write before a repeated START carries the register address and
+//   optionally the number of bytes the host is going to read. The read
+//   returns that many bytes, or up to the end of the buffer, followed 
+//   by the PEC of the whole transaction.
+void i2c_enable_pec(int enable);
+
+// Number of writes rejected because of a bad PEC
+uint32_t i2c_pec_errors(void);
+
+// Bus errors, each of them drops the current transfer
+#define I2C_ERROR_BUS           0   // misplaced START or STOP
+#define I2C_ERROR_ARBITRATION   1   // SDA overridden while transmitting
+#define I2C_ERROR_OVERRUN       2   // overrun or underrun
+#define I2C_ERROR_TIMEOUT       3   // SCL held low with no progress, I2C1 reset
+#define I2C_ERRORS              4
+
+// The F030 has no SMBus TIMEOUTR: while addressed, the slave checks
+// every I2C_TIMEOUT_MS, with SysTick, that the transfer moves on.
+#define I2C_TIMEOUT_MS          25
+
+uint32_t i2c_error_count(uint32_t error);
+
+// Trace of the last I2C_TRACE_ENTRIES transfers, a power of 2, kept
+// when built with I2C_TRACE
+#define I2C_TRACE_ENTRIES       16
+
+#define I2C_TRACE_READ          0x80    // direction, write if clear
+#define I2C_TRACE_STOP          0x01    // how the transfer ended
+#define I2C_TRACE_RESTART       0x02
+#define I2C_TRACE_NACK          0x03    // read ended by the host's NACK
+#define I2C_TRACE_ERROR         0x04    // bus error, transfer dropped
+#define I2C_TRACE_TIMEOUT       0x05    // bus stuck, I2C1 reset
+#define I2C_TRACE_PEC           0x06    // write rejected, bad PEC
+
+typedef struct {
+    uint32_t time;      // systick_now() at the end of the transfer
+    uint16_t reg;       // first register
+    uint8_t len;        // data bytes, up to 255
+    uint8_t flags;      // I2C_TRACE_READ | ending
+} i2c_trace_t;
+
+#ifdef I2C_TRACE
+
+// Copy the trace, oldest first, to entries[I2C_TRACE_ENTRIES].
+// Returns the number of entries copied.
+uint32_t i2c_trace_copy(i2c_trace_t *entries);
+
+// The trace as registers: the number of transfers traced since reset 
+// (32-bit), followed by the entries, oldest first
+#define I2C_TRACE_BYTES         (4 + I2C_TRACE_ENTRIES*sizeof(i2c_trace_t))
+extern const i2c_provider_t i2c_trace_provider;
+
+#endif
 
 uint32_t i2c_tx_count(void);
 
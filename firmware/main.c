@@ -1,4 +1,5 @@
 #include <stm32f0xx.h>
+#include <stddef.h>
 #include "systick.h"
 #include "usart.h"
 #include "adc.h"
@@ -6,65 +7,85 @@
 #include "i2c_slave.h"
 #include "rtc.h"
 #include "time_conv.h"
+#include "event.h"
+#include "sched.h"
+#include "filter.h"
+#include "history.h"
+#include "soc.h"
+#include "regs.h"
 
 #define PIVOYAGER_FIRMWARE_VERSION 0x0010
 
-typedef struct {
-    // 0
-    uint8_t MODE;   // either 'N' or 'B'
-    uint8_t STAT;   // status
-    uint8_t CONF;   // enable pin WD, etc., commit change
-    uint8_t PROG;   // schedule an operation   
-
-    // 4
-    uint32_t TIME;
-    uint32_t DATE;
-    
-    // 12
-    uint32_t SET_TIME;
-    uint32_t SET_DATE;
+// Speed of the host's I2C bus, see i2c_slave.h
+#ifndef I2C_SPEED
+#define I2C_SPEED I2C_SPEED_FAST
+#endif
 
-    // 20
-    uint16_t WATCH;
-    uint16_t WAKE;
+static regs_t REGS;
 
-    // 24
-    uint32_t ALARM;
-    uint16_t BOOT;
+// Snapshots of REGS served to the I2C host, see i2c_publish()
+static regs_t REGS_IMAGE[2];
+
+/* Register space beyond REGS, on the 16-bit address (see i2c_map()):
+ *   0x0100  RTC backup registers BKP0R to BKP2R, read/write, 12 bytes
+ *           (BKP3R and BKP4R keep the VBAT thresholds, see save_vbat_levels())
+ *   0x0200  device info from system memory: UID (12 bytes), TS_CAL, 
+ *           VREF_CAL, 16 bytes
+ *   0x0210  build info: firmware version and build date, 24 bytes
+ *   0x0300  trace of the last I2C transfers, with I2C_TRACE (see i2c_slave.h)
+ *   0x0400  per-minute VBAT_MV history, 484 bytes (see history.h)
+ */
+#define MAP_BACKUP          0x0100
+#define MAP_DEVICE          0x0200
+#define MAP_BUILD           0x0210
+#define MAP_TRACE           0x0300
+#define MAP_HISTORY         0x0400
+
+#define BACKUP_REGS         3
+#define DEVICE_INFO         ((const uint8_t *)0x1FFFF7AC)
+#define DEVICE_INFO_SIZE    16
+
+static const struct {
     uint16_t FW_VERSION;
+    char BUILD[22];
+} BUILD_INFO = { PIVOYAGER_FIRMWARE_VERSION, __DATE__ " " __TIME__ };
 
-    // 32
-    uint16_t VBAT;
-    uint16_t VREF;
-    uint16_t VREF_CAL;
-    uint16_t LBO_TIMER;
+static void read_backup(uint32_t offset, uint8_t *data, uint32_t len)
+{
+    for (; len>0; offset++, len--)
+        *data++ = rtc_read_backup_register(offset>>2) >> (8*(offset&3));
+}
 
-    // Total size: 40 bytes
-} regs_t;
+static void write_backup(uint32_t offset, uint8_t data)
+{
+    uint32_t shift = 8*(offset&3);
+    uint32_t value = rtc_read_backup_register(offset>>2);
 
-static regs_t REGS;
+    value = (value & ~(0xFFU<<shift)) | ((uint32_t)data<<shift);
+    rtc_write_backup_register(offset>>2, value);
+}
+
+static const i2c_provider_t BACKUP_PROVIDER = { .read = read_backup, .write = write_backup };
+static const i2c_provider_t DEVICE_PROVIDER = { .buf = DEVICE_INFO };
+static const i2c_provider_t BUILD_PROVIDER = { .buf = (const uint8_t *)&BUILD_INFO };
+static const i2c_provider_t HISTORY_PROVIDER = { .read = history_read, .begin = history_begin };
+
+// Test a field of REGS in the bitmap returned by i2c_take_dirty()
+#define REGS_DIRTY(dirty, field) \
+    regs_dirty(dirty, offsetof(regs_t, field), sizeof(((regs_t *)0)->field))
+
+static inline int regs_dirty(const uint32_t *dirty, uint32_t offset, uint32_t size)
+{
+    for (; size>0; offset++, size--)
+    {
+        if (((dirty[offset>>5] >> (offset&31)) & 1) != 0)
+            return 1;
+    }
+    return 0;
+}
     
 static uint8_t SHADOW_CONF = 0;
 
-static const regs_t REGS_MASK = {
-  .MODE       = 0x00,
-  .STAT       = 0x00,
-  .CONF       = 0xFF,
-  .PROG       = 0xFF,
-  .TIME       = 0x00000000,
-  .DATE       = 0x00000000,
-  .SET_TIME   = 0xFFFFFFFF,
-  .SET_DATE   = 0xFFFFFFFF,
-  .WATCH      = 0xFFFF,
-  .WAKE       = 0xFFFF,
-  .ALARM      = 0xFFFFFFFF,
-  .BOOT       = 0x0000,
-  .FW_VERSION = 0x0000,
-  .VBAT       = 0x0000,
-  .VREF       = 0x0000,
-  .VREF_CAL   = 0xFFFF,
-  .LBO_TIMER  = 0xFFFF
-};
 
 #define STAT_PG         0x01
 #define STAT_STAT1      0x02
@@ -80,14 +101,70 @@ static const regs_t REGS_MASK = {
 #define CONF_WAKE_ALARM     0x08
 #define CONF_WAKE_POWER     0x10
 #define CONF_WAKE_BUTTON    0x20
+#define CONF_I2C_PEC        0x40    // SMBus PEC on i2c transactions
 #define CONF_LBO_SHUTDOWN   0x80
 
+#define ADC_CONF_LOW_POWER  0x01    // ADC and divider only on around conversions
 
+
+#define PROG_CLEAR_TEMP     0x04    // restart TEMP_MIN and TEMP_MAX
+#define PROG_SAMPLE         0x08    // take a fresh VBAT sample now
 #define PROG_CLEAR_ALARM    0x10
 #define PROG_CLEAR_BUTTON   0x20
 #define PROG_CALENDAR       0x40
 #define PROG_ALARM          0x80
 
+#define INT_PG              0x01    // STAT_PG changed
+#define INT_CHARGER         0x02    // STAT_STAT1 or STAT_STAT2 changed
+#define INT_LBO             0x04    // charger entered low battery
+#define INT_VBAT_LOW        0x08    // VBAT fell below VBAT_LOW_MV
+#define INT_VBAT_CRIT       0x10    // VBAT fell below VBAT_CRIT_MV
+#define INT_ALARM           0x40    // RTC alarm
+#define INT_BUTTON          0x80    // short button press
+
+#define CMD_STATUS_OK       0x00
+#define CMD_STATUS_FAIL     0x01
+
+/* PROG commands are queued by the I2C interrupt handler, together with
+ * a copy of their arguments, and executed in order by PendSV, pended at
+ * the end of the write. PendSV has the lowest priority: it runs right 
+ * after the I2C handler, whatever the main loop is busy with, and never
+ * delays another interrupt.
+ * The handler is the only producer and PendSV the only consumer, so the
+ * free-running indices need no locking.
+ */
+typedef struct {
+    uint8_t PROG;
+    uint8_t SEQ;
+    uint32_t SET_TIME;
+    uint32_t SET_DATE;
+    uint32_t ALARM;
+} command_t;
+
+#define COMMAND_QUEUE_SIZE 4
+
+static command_t COMMANDS[COMMAND_QUEUE_SIZE];
+static volatile uint32_t command_head;
+static volatile uint32_t command_tail;
+
+// Set while the main loop goes through a sequence on the RTC registers,
+// which commands touch too (write protection, INIT, ALRAWF): PendSV then
+// leaves the queue alone until release_commands() pends it again. The 
+// M0 has no BASEPRI to mask PendSV alone.
+static volatile int commands_held;
+
+static void hold_commands(void)
+{
+    commands_held = 1;
+}
+
+static void release_commands(void)
+{
+    commands_held = 0;
+    if (command_tail != command_head)
+        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+}
+
 static void halt(void) 
 {
      usart_printf("Halted.\n");
@@ -104,6 +181,13 @@ enum {
 
 int button_state = BUTTON_NONE;
 
+/* Scheduler task ids, see main() */
+static int button_task;
+static int leds_task;
+static int datetime_task;
+static int watchdog_task;
+static int lbo_task;
+
 #ifdef INVERTED_LOGIC
   #define PRESSED(x) ((x)==0)
 #else
@@ -133,6 +217,10 @@ static inline int fetch_button_state(void)
                 {
                     button_state = BUTTON_MAINTAINED;
                 }
+                else
+                {
+                    sched_at(button_task, button_change+3001);
+                }
             }
             else
             {
@@ -140,6 +228,7 @@ static inline int fetch_button_state(void)
                     button_state = BUTTON_NONE;
                     return BUTTON_SHORT;
                 }
+                sched_at(button_task, button_change+41);
             }
             break;
         case BUTTON_MAINTAINED:
@@ -179,6 +268,15 @@ enum {
 };
 
 
+// Shortest half-period of the blinking LEDs, 0 if none blinks 
+static uint32_t led_blink;
+
+static inline void update_led_blink(uint32_t half_period)
+{
+    if (led_blink==0 || half_period<led_blink)
+        led_blink = half_period;
+}
+
 static inline void update_led(int led, int pattern)
 {
     uint32_t now = systick_now();
@@ -195,12 +293,14 @@ static inline void update_led(int led, int pattern)
                 gpio_clear(led);
             else
                 gpio_set(led);
+            update_led_blink(500);
             break;
         case LED_PATTERN_FAST:
             if (((now/100)&1)==0)
                 gpio_clear(led);
             else
                 gpio_set(led);
+            update_led_blink(100);
             break; 
     }
 }
@@ -211,27 +311,167 @@ static inline void update_datetime(void)
     REGS.DATE = rtc_get_date();
 }
 
-static inline void update_adc(void) 
-{
-    static uint32_t last_adc = 0;
-    static int trigger = 0;
-    uint32_t now = systick_now();
+// Sequences of VBAT, temperature and VREF conversions per second
+#ifndef ADC_RATE
+#define ADC_RATE 16
+#endif
+
+// Battery voltage divider in front of ADC_IN6
+#define VBAT_DIVIDER 2
+
+// Sequences per second of a sample requested with PROG_SAMPLE, a block
+// then takes 16 ms. The divider stays on at this rate, and the period 
+// is not shorter than its settling time (ADC_SETTLE in adc.c).
+#define ADC_SAMPLE_RATE 1000
+
+static filter_t vbat_filter;
 
-    if (trigger == 0)
+// Set by PendSV on PROG_SAMPLE, then by the main loop once the ADC runs
+// at ADC_SAMPLE_RATE
+static volatile int vbat_sample = 0;
+#define VBAT_SAMPLE_REQUESTED   1
+#define VBAT_SAMPLE_RUNNING     2
+
+// Cleared by PendSV on PROG_CLEAR_TEMP
+static volatile int temp_tracked = 0;
+
+// Called from the DMA interrupt handler with a block of samples
+static void filter_adc(const uint16_t *samples)
+{
+    uint32_t vbat = 0;
+    uint32_t temp = 0;
+    uint32_t vref = 0;
+    uint32_t cal = REGS.VREF_CAL ? REGS.VREF_CAL : VREFINT_CAL;
+    uint32_t mv;
+    int16_t t;
+
+    for (int i=0; i<ADC_BLOCK; i++)
     {
-        if ((now-last_adc)>=1000)
-        {
-            gpio_set(GPIO_OUT_ADC_BAT);
-            trigger = 1;
-        }
+        vbat += samples[i*ADC_CHANNELS];
+        temp += samples[i*ADC_CHANNELS+1];
+        vref += samples[i*ADC_CHANNELS+2];
     }
-    else
+    REGS.VBAT = vbat / ADC_BLOCK;
+    REGS.VREF = vref / ADC_BLOCK;
+
+    // oversampled to 14 bits
+    mv = adc_millivolts(4*vbat/ADC_BLOCK, 4*vref/ADC_BLOCK, cal) * VBAT_DIVIDER;
+    REGS.VBAT_MV = filter_update(&vbat_filter, mv, REGS.VBAT_FILTER);
+
+    t = adc_temperature(4*temp/ADC_BLOCK, 4*vref/ADC_BLOCK, cal);
+    REGS.TEMP = t;
+    if (!temp_tracked || t < REGS.TEMP_MIN)
+        REGS.TEMP_MIN = t;
+    if (!temp_tracked || t > REGS.TEMP_MAX)
+        REGS.TEMP_MAX = t;
+    temp_tracked = 1;
+
+    if (vbat_sample == VBAT_SAMPLE_RUNNING)
+    {
+        // the whole block was converted after the request
+        vbat_sample = 0;
+        REGS.VBAT_SEQ++;
+    }
+    i2c_touch();
+    event_raise(EVENT_ADC);
+}
+
+// Minimum gap between VBAT_LOW_MV and VBAT_HIGH_MV, in mV
+#define VBAT_HYSTERESIS 100
+
+enum {
+    VBAT_NORMAL,
+    VBAT_LOW,
+    VBAT_CRITICAL
+};
+
+static int vbat_level = VBAT_NORMAL;
+
+// The analog watchdog tripped, it is re-armed after the next block
+static int vbat_tripped = 0;
+
+// Level above which the low battery state ends
+static uint32_t vbat_restart_mv(void)
+{
+    uint32_t low = REGS.VBAT_LOW_MV > REGS.VBAT_CRIT_MV ? REGS.VBAT_LOW_MV : REGS.VBAT_CRIT_MV;
+
+    if (REGS.VBAT_HIGH_MV < low + VBAT_HYSTERESIS)
+        return low + VBAT_HYSTERESIS;
+    return REGS.VBAT_HIGH_MV;
+}
+
+/* The level follows the filtered VBAT_MV, see vbat_level_for(), so that
+ * a load transient does not shut the Pi down. The ADC analog watchdog 
+ * compares every single conversion with a window around the current
+ * level: VBAT_LOW_MV (or VBAT_CRIT_MV) and up, then VBAT_CRIT_MV to the
+ * restart level. It only wakes the main loop, which looks at the level
+ * again once the next block is filtered and re-arms it. The thresholds
+ * are converted to ADC results with the last VREF measurement.
+ */
+static void run_vbat_watchdog(void)
+{
+    uint32_t cal = REGS.VREF_CAL ? REGS.VREF_CAL : VREFINT_CAL;
+    uint32_t vref = REGS.VREF ? REGS.VREF : cal;
+    uint32_t low = REGS.VBAT_LOW_MV ? REGS.VBAT_LOW_MV : REGS.VBAT_CRIT_MV;
+    uint32_t crit = REGS.VBAT_CRIT_MV;
+
+    if (low == 0)
     {
-        adc_acquire(&REGS.VBAT);
-        last_adc = now;
-        gpio_clear(GPIO_OUT_ADC_BAT);
-        trigger = 0;
+        vbat_level = VBAT_NORMAL;
+        adc_set_watchdog(0, 4095);
+        return;
     }
+
+    if (vbat_level == VBAT_NORMAL)
+        adc_set_watchdog(adc_threshold(low/VBAT_DIVIDER, vref, cal), 4095);
+    else
+        adc_set_watchdog(vbat_level == VBAT_LOW ? adc_threshold(crit/VBAT_DIVIDER, vref, cal) : 0,
+            adc_threshold(vbat_restart_mv()/VBAT_DIVIDER, vref, cal));
+}
+
+// Level for a filtered VBAT_MV, with the hysteresis of the restart level
+static int vbat_level_for(uint32_t mv)
+{
+    if (REGS.VBAT_CRIT_MV != 0 && mv < REGS.VBAT_CRIT_MV)
+        return VBAT_CRITICAL;
+    if (vbat_level != VBAT_NORMAL && mv > vbat_restart_mv())
+        return VBAT_NORMAL;
+    if (vbat_level == VBAT_NORMAL && REGS.VBAT_LOW_MV != 0 && mv < REGS.VBAT_LOW_MV)
+        return VBAT_LOW;
+    return vbat_level;
+}
+
+/* The thresholds are kept in RTC backup registers BKP3R and BKP4R, which
+ * survive standby, so that the Pi is only started again once VBAT is 
+ * above VBAT_HIGH_MV. BKP4R holds a marker in its upper half.
+ */
+#define VBAT_LEVELS_BKP     3
+#define VBAT_LEVELS_MARKER  0x5642
+
+static void save_vbat_levels(void)
+{
+    rtc_write_backup_register(VBAT_LEVELS_BKP, REGS.VBAT_LOW_MV | ((uint32_t)REGS.VBAT_HIGH_MV<<16));
+    rtc_write_backup_register(VBAT_LEVELS_BKP+1, REGS.VBAT_CRIT_MV | ((uint32_t)VBAT_LEVELS_MARKER<<16));
+}
+
+static void load_vbat_levels(void)
+{
+    uint32_t levels = rtc_read_backup_register(VBAT_LEVELS_BKP);
+    uint32_t crit = rtc_read_backup_register(VBAT_LEVELS_BKP+1);
+
+    if ((crit>>16) != VBAT_LEVELS_MARKER)
+        return;
+    REGS.VBAT_LOW_MV = levels;
+    REGS.VBAT_HIGH_MV = levels>>16;
+    REGS.VBAT_CRIT_MV = crit;
+}
+
+// Whether the Pi must wait for the battery to recover before starting
+static int vbat_too_low_to_start(void)
+{
+    if ((REGS.VBAT_LOW_MV == 0 && REGS.VBAT_CRIT_MV == 0) || (REGS.STAT & STAT_PG) != 0)
+        return 0;
+    return REGS.VBAT_MV <= vbat_restart_mv();
 }
 
 static void update_led_patterns(int st_pattern)
@@ -301,6 +541,105 @@ const char *screen[10]={
   ""
 };
 
+// Called from the I2C interrupt handler
+static void queue_command(uint32_t reg, uint32_t len)
+{
+    command_t *cmd;
+
+    if (reg>offsetof(regs_t, PROG) || reg+len<=offsetof(regs_t, PROG) || REGS.PROG==0)
+        return;
+
+    if (command_head-command_tail >= COMMAND_QUEUE_SIZE)
+    {
+        REGS.CMD_LOST++;
+    }
+    else
+    {
+        cmd = &COMMANDS[command_head % COMMAND_QUEUE_SIZE];
+        cmd->PROG = REGS.PROG;
+        cmd->SEQ = ++REGS.CMD_ISSUED;
+        cmd->SET_TIME = REGS.SET_TIME;
+        cmd->SET_DATE = REGS.SET_DATE;
+        cmd->ALARM = REGS.ALARM;
+        command_head++;
+        SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+    }
+    REGS.PROG = 0;
+}
+
+// Called from the I2C interrupt handler: the events the host has just 
+// read in INT_CAUSE are cleared, those raised since the snapshot remain.
+static void ack_interrupts(uint32_t reg, uint32_t len, const uint8_t *image)
+{
+    uint8_t cause;
+
+    if (reg>offsetof(regs_t, INT_CAUSE) || reg+len<=offsetof(regs_t, INT_CAUSE))
+        return;
+
+    cause = ((const regs_t *)image)->INT_CAUSE;
+    REGS.INT_CAUSE &= ~cause;
+
+    // Until the next i2c_publish(), a new read would be served from an
+    // image that still holds them
+    REGS_IMAGE[0].INT_CAUSE &= ~cause;
+    REGS_IMAGE[1].INT_CAUSE &= ~cause;
+    i2c_touch();
+}
+
+static void raise_interrupt(uint8_t cause)
+{
+    // INT_CAUSE is also modified by ack_interrupts()
+    __disable_irq();
+    REGS.INT_CAUSE |= cause;
+    __enable_irq();
+}
+
+static void check_interrupts(uint8_t old_stat, uint8_t new_stat)
+{
+    uint8_t changed = old_stat ^ new_stat;
+    uint8_t cause = 0;
+
+    if ((changed & STAT_PG) != 0)
+        cause |= INT_PG;
+    if ((changed & (STAT_STAT1 | STAT_STAT2)) != 0)
+        cause |= INT_CHARGER;
+    if ((changed & 7) != 0 && (new_stat & 7) == STAT_STAT2)
+        cause |= INT_LBO;
+    if ((changed & new_stat & STAT_ALARM) != 0)
+        cause |= INT_ALARM;
+
+    if (cause)
+        raise_interrupt(cause);
+}
+
+static void configure_int_line(void)
+{
+    if (REGS.INT_ENABLE != 0)
+    {
+        gpio_clear(GPIO_OUT_INT);
+        gpio_config_pullupdown(GPIO_OUT_INT, GPIO_PULL_NONE);
+        gpio_enable_output(GPIO_OUT_INT);
+    }
+    else
+    {
+        gpio_enable_input(GPIO_TP2);
+        gpio_config_pullupdown(GPIO_TP2, GPIO_PULL_DOWN);
+    }
+}
+
+// The line is high while an enabled event is pending, the host sees a 
+// rising edge for each new batch of events.
+static void update_int_line(void)
+{
+    if (REGS.INT_ENABLE == 0)
+        return;
+
+    if ((REGS.INT_CAUSE & REGS.INT_ENABLE) != 0)
+        gpio_set(GPIO_OUT_INT);
+    else
+        gpio_clear(GPIO_OUT_INT);
+}
+
 static void init(void)
 {
     int status;
@@ -349,6 +688,17 @@ static void init(void)
     gpio_config_pullupdown(GPIO_TP2, GPIO_PULL_DOWN);
 
     gpio_enable_input(GPIO_IN_BUTTON);
+
+    // button, watchdog and charger status edges wake up the main loop
+    gpio_enable_interrupt(GPIO_IN_BUTTON, GPIO_EDGE_RISING | GPIO_EDGE_FALLING);
+    gpio_enable_interrupt(GPIO_IN_WATCHDOG, GPIO_EDGE_RISING);
+    gpio_enable_interrupt(GPIO_IN_PG, GPIO_EDGE_RISING | GPIO_EDGE_FALLING);
+    gpio_enable_interrupt(GPIO_IN_STAT2, GPIO_EDGE_RISING | GPIO_EDGE_FALLING);
+    gpio_enable_interrupt(GPIO_IN_STAT1, GPIO_EDGE_RISING | GPIO_EDGE_FALLING);
+    gpio_enable_interrupt(GPIO_IN_PG2, GPIO_EDGE_RISING | GPIO_EDGE_FALLING);
+    NVIC_EnableIRQ(EXTI0_1_IRQn);
+    NVIC_EnableIRQ(EXTI2_3_IRQn);
+    NVIC_EnableIRQ(EXTI4_15_IRQn);
     usart_printf("[OK]\n");
 
     /* BUTTON STATUS */
@@ -365,13 +715,22 @@ static void init(void)
     /* I2C INIT */
     usart_printf("I2C init: ");
 
-    i2c_slave_init(0x65);
-
-    i2c_set_buffer((uint8_t *)&REGS, (const uint8_t *)&REGS_MASK, sizeof(REGS));
+    i2c_slave_init(0x65, I2C_SPEED);
+    // same registers with 16-bit addresses, and the regions beyond them
+    i2c_enable_wide_address(0x66);
+
+    i2c_set_buffer((uint8_t *)&REGS, sizeof(REGS));
+    i2c_set_writable(REGS_WRITABLE_RANGES, sizeof(REGS_WRITABLE_RANGES)/sizeof(REGS_WRITABLE_RANGES[0]));
+    i2c_set_images((uint8_t *)REGS_IMAGE);
+    i2c_set_write_handler(queue_command);
+    // commands queued by the handler run at the lowest priority
+    NVIC_SetPriority(PendSV_IRQn, 3);
+    i2c_set_read_handler(ack_interrupts);
     usart_printf("[OK]\n");
 
     /* RTC INIT */
     usart_printf("RTC init: ");
+    hold_commands();
     if ((status=rtc_init())<0)
     {
          usart_printf("[Failed] code=%i\n", status);
@@ -382,6 +741,18 @@ static void init(void)
     else
         usart_printf("[OK] calendar was reset.\n");
 
+    rtc_enable_alarm_interrupt();
+    release_commands();
+
+    // backup registers are only writable once the RTC is initialized
+    i2c_map(MAP_BACKUP, 4*BACKUP_REGS, &BACKUP_PROVIDER);
+    i2c_map(MAP_DEVICE, DEVICE_INFO_SIZE, &DEVICE_PROVIDER);
+    i2c_map(MAP_BUILD, sizeof(BUILD_INFO), &BUILD_PROVIDER);
+    i2c_map(MAP_HISTORY, HISTORY_BYTES, &HISTORY_PROVIDER);
+#ifdef I2C_TRACE
+    i2c_map(MAP_TRACE, I2C_TRACE_BYTES, &i2c_trace_provider);
+#endif
+
     memzero(&REGS, sizeof(REGS));
 
     REGS.MODE = 'N';
@@ -389,11 +760,28 @@ static void init(void)
     REGS.CONF = SHADOW_CONF = (CONF_WAKE_BUTTON | CONF_LBO_SHUTDOWN);
     REGS.BOOT = pwr_csr;
     REGS.LBO_TIMER = 60;
+    REGS.VBAT_FILTER = FILTER_MEDIAN | 2;
+    REGS.TIME_TO_EMPTY = SOC_UNKNOWN;
+    REGS.TIME_TO_FULL = SOC_UNKNOWN;
+    REGS.ADC_CONF = ADC_CONF_LOW_POWER;
+    load_vbat_levels();
     REGS.FW_VERSION = PIVOYAGER_FIRMWARE_VERSION;
 
     usart_printf("Init done. Entering main loop.\n");
 }
 
+#ifdef I2C_TRACE
+static void dump_i2c_trace(void)
+{
+    i2c_trace_t trace[I2C_TRACE_ENTRIES];
+    uint32_t n = i2c_trace_copy(trace);
+
+    usart_printf("time reg len flags\n");
+    for (uint32_t i=0; i<n; i++)
+        usart_printf("%u %x %u %x\n", trace[i].time, trace[i].reg, trace[i].len, trace[i].flags);
+}
+#endif
+
 static void process_usart(void)
 {
     if (usart_getc()=='d')
@@ -404,6 +792,9 @@ static void process_usart(void)
             usart_printf("%x ", ((uint8_t *)&REGS)[i]);
         }
         usart_printf("\n");
+#ifdef I2C_TRACE
+        dump_i2c_trace();
+#endif
     }
     else
     {
@@ -411,10 +802,48 @@ static void process_usart(void)
     }
 }
 
+void EXTI0_1_IRQHandler(void)
+{
+    gpio_clear_interrupt(GPIO_IN_PG);
+    event_raise(EVENT_STATUS);
+}
+
+void EXTI2_3_IRQHandler(void)
+{
+    gpio_clear_interrupt(GPIO_IN_STAT2);
+    gpio_clear_interrupt(GPIO_IN_STAT1);
+    event_raise(EVENT_STATUS);
+}
+
+void EXTI4_15_IRQHandler(void)
+{
+    if (gpio_interrupt_pending(GPIO_IN_BUTTON))
+    {
+        gpio_clear_interrupt(GPIO_IN_BUTTON);
+        event_raise(EVENT_BUTTON);
+    }
+    if (gpio_interrupt_pending(GPIO_IN_WATCHDOG))
+    {
+        gpio_clear_interrupt(GPIO_IN_WATCHDOG);
+        event_raise(EVENT_WATCHDOG);
+    }
+    if (gpio_interrupt_pending(GPIO_IN_PG2))
+    {
+        gpio_clear_interrupt(GPIO_IN_PG2);
+        event_raise(EVENT_STATUS);
+    }
+}
+
 static void go_to_standby_mode(void)
 {
   PWR->CR  |= PWR_CR_CWUF;
 
+  /* Commands are left queued, they would undo the RTC setup below */
+  hold_commands();
+
+  /* The alarm interrupt is used by the main loop, only keep it if it is a wake source (below) */
+  rtc_disable_alarm_interrupt();
+
   /* Power down raspberry-pi */
   gpio_clear(GPIO_OUT_EN);
 
@@ -481,30 +910,229 @@ static void go_to_standby_mode(void)
   __WFI();
 }
 
+static uint8_t BUTTON_STAT = 0;
+static uint32_t led_pattern = LED_PATTERN_ON;
+static uint32_t last_event = 0;
+static uint8_t cmd_reported;
+static uint32_t lbo_start;
+static int lbo = 0;
+
+static void run_button(uint32_t now)
+{
+    switch (fetch_button_state())
+    {
+        case BUTTON_SHORT:
+            BUTTON_STAT = STAT_BUTTON;
+            raise_interrupt(INT_BUTTON);
+            usart_printf("Short press...\n");
+            break;
+        case BUTTON_MAINTAINED:
+            led_pattern = LED_PATTERN_FAST;
+            sched_at(leds_task, now);
+            break;
+        case BUTTON_LONG:
+            led_pattern = LED_PATTERN_ON;
+            usart_printf("Long press...\n");
+
+            systick_delay(100);
+
+            usart_printf("Sleeping.");
+
+            go_to_standby_mode();
+            break;
+    }
+}
+
+static void run_leds(uint32_t now)
+{
+    led_blink = 0;
+    update_led_patterns(led_pattern);
+    if (led_blink!=0)
+        sched_at(leds_task, (now/led_blink+1)*led_blink);
+}
+
+static void run_datetime(uint32_t now)
+{
+    update_datetime();
+    // REGS.TIME and REGS.DATE change on the next RTC second
+    sched_at(datetime_task, now+rtc_ms_to_next_second());
+}
+
+static void run_history(uint32_t now)
+{
+    history_close();
+    soc_minute();
+    REGS.TIME_TO_EMPTY = soc_time_to_empty();
+    REGS.TIME_TO_FULL = soc_time_to_full();
+}
+
+// Charger state for the battery estimates, from STAT2, STAT1 and PG
+static int charger_state(void)
+{
+    if ((REGS.STAT & STAT_PG) == 0)
+        return SOC_DISCHARGING;
+    if ((REGS.STAT & (STAT_STAT1 | STAT_STAT2)) == STAT_STAT2)
+        return SOC_CHARGING;
+    if ((REGS.STAT & (STAT_STAT1 | STAT_STAT2)) == STAT_STAT1)
+        return SOC_FULL;
+    return SOC_IDLE;
+}
+
+static void run_watchdog(uint32_t now)
+{
+    if ((SHADOW_CONF & (CONF_I2C_WD | CONF_PIN_WD))==0)
+        return;
+
+    if ((SHADOW_CONF & CONF_PIN_WD)!=0 && gpio_read(GPIO_IN_WATCHDOG)!=0)
+    {
+        last_event = now;
+    }
+
+    if (now-last_event>(uint32_t)REGS.WATCH*1000)
+    {
+      usart_printf("Going on standby because of watchdog: now=%u last=%u watch=%u\n", now, last_event, REGS.WATCH);    
+      go_to_standby_mode();
+    }
+    sched_at(watchdog_task, last_event+(uint32_t)REGS.WATCH*1000+1);
+}
+
+// Low battery according to the filtered VBAT_MV if VBAT_LOW_MV or 
+// VBAT_CRIT_MV is set, otherwise according to the charger
+static int battery_low(void)
+{
+    if (REGS.VBAT_LOW_MV != 0 || REGS.VBAT_CRIT_MV != 0)
+        return vbat_level != VBAT_NORMAL;
+    return (REGS.STAT&7)==STAT_STAT2;
+}
+
+static void run_lbo(uint32_t now)
+{
+    if ((SHADOW_CONF & CONF_LBO_SHUTDOWN)==0)
+        return;
+
+    if (vbat_level == VBAT_CRITICAL)
+    {
+        usart_printf("Going on standby because VBAT (%umV) is critical.\n", REGS.VBAT_MV);
+        go_to_standby_mode();
+    }
+
+    if (lbo==0)
+    {
+      if (battery_low())
+      {
+        lbo = 1;
+        lbo_start = now;
+        usart_printf("Low battery with programmed shutdown in %us\n", REGS.LBO_TIMER);
+      }
+    }
+    else
+    {
+      if (!battery_low())
+      {
+        lbo = 0;
+        usart_printf("Low battery status ended.\n");
+      }
+      else
+      {
+        if (now-lbo_start>(uint32_t)REGS.LBO_TIMER*1000)
+        {
+          usart_printf("Going on standby because VBAT (%u) too low for %u seconds.\n", REGS.VBAT, REGS.LBO_TIMER);
+          go_to_standby_mode(); 
+        }
+      }
+    }
+    if (lbo)
+      sched_at(lbo_task, lbo_start+(uint32_t)REGS.LBO_TIMER*1000+1);
+}
+
+static uint8_t execute_command(const command_t *cmd)
+{
+    uint8_t status = CMD_STATUS_OK;
+
+    if ((cmd->PROG & PROG_CLEAR_BUTTON) != 0) {
+        BUTTON_STAT = 0;
+    }
+    if ((cmd->PROG & PROG_CLEAR_ALARM) != 0) {
+        RTC->ISR &= ~RTC_ISR_ALRAF;
+    }
+    if ((cmd->PROG & PROG_CLEAR_TEMP) != 0) {
+        temp_tracked = 0;
+    }
+    if ((cmd->PROG & PROG_SAMPLE) != 0) {
+        // the ADC is restarted by the main loop
+        vbat_sample = VBAT_SAMPLE_REQUESTED;
+    }
+    if ((cmd->PROG & PROG_CALENDAR) != 0) {
+        rtc_disable_write_protection();
+        if (rtc_enable_calendar_init()==0) {
+          rtc_set_time(cmd->SET_TIME);
+          rtc_set_date(cmd->SET_DATE);
+          rtc_disable_calendar_init();
+        } else {
+          status = CMD_STATUS_FAIL;
+        }
+        rtc_enable_write_protection();
+    }
+    if ((cmd->PROG & PROG_ALARM) != 0) {
+        rtc_disable_write_protection();
+        rtc_disable_alarm();
+        rtc_set_alarm(cmd->ALARM);
+        rtc_enable_alarm();
+        rtc_enable_write_protection();
+    }
+    return status;
+}
+
+// Commands are run here rather than in the main loop, so they must not 
+// print on the console or touch the scheduler: the main loop reports 
+// them and refreshes the date and time once it gets around.
+void PendSV_Handler(void)
+{
+    const command_t *cmd;
+
+    if (commands_held)
+        return;
+
+    while (command_tail != command_head)
+    {
+        cmd = &COMMANDS[command_tail % COMMAND_QUEUE_SIZE];
+        REGS.CMD_STATUS = execute_command(cmd);
+        REGS.CMD_DONE = cmd->SEQ;
+        command_tail++;
+    }
+    i2c_touch();
+}
+
 int main(void)
 {
     // SystemInit() is called before main() from startup_stm32f0xx.c 
     init();
 
-    uint8_t BUTTON_STAT = 0;
-    uint32_t led_pattern = LED_PATTERN_ON; 
-    uint32_t rx_count = i2c_rx_count();
-    uint32_t tx_count = i2c_tx_count();
-    uint32_t last_event = 0;
-    uint8_t stat;
+    uint32_t events;
     uint32_t now = 0;
-    uint32_t lbo_start;
-    int lbo = 0;
+    uint32_t next;
+    uint32_t dirty[I2C_DIRTY_WORDS];
+    uint8_t stat;
+    int sampling = 0;   // ADC running at ADC_SAMPLE_RATE
+
 
+    // the ADC drives the battery divider while sampling, only around
+    // conversions unless the host clears ADC_CONF_LOW_POWER
+    adc_set_block_handler(filter_adc);
+    adc_set_low_power((REGS.ADC_CONF & ADC_CONF_LOW_POWER)!=0);
+    adc_start(ADC_RATE);
+    run_vbat_watchdog();
 
     for (;;)
     {
       REGS.STAT = fetch_status();
       
-      if ((REGS.STAT&7)!=STAT_STAT2)
+      // VBAT_MV is 0 until the first ADC block
+      if ((REGS.STAT&7)!=STAT_STAT2 && !vbat_too_low_to_start())
         break;
 
       update_led_patterns(0);
+      i2c_publish();
 
       if ((now&7)==STAT_STAT2) {
         usart_printf("Battery too low to start.\n");
@@ -516,141 +1144,173 @@ int main(void)
 
     gpio_set(GPIO_OUT_EN);
 
+    now = systick_now();
+    button_task   = sched_add(run_button, 0, now);
+    leds_task     = sched_add(run_leds, 0, now);
+    datetime_task = sched_add(run_datetime, 0, now);
+    watchdog_task = sched_add(run_watchdog, 0, now);
+    lbo_task      = sched_add(run_lbo, 0, now);
+    sched_add(run_history, 60000, now+60000);
+
+    event_raise(EVENT_TICK);
+
     for(;;)
     {
-        stat = fetch_status();
+        // Sleep until an interrupt raises an event: the I2C slave on
+        // STOP, the next scheduler deadline, the button, the watchdog 
+        // pin, the charger status pins, the console, the RTC alarm, a
+        // new ADC block or the VBAT watchdog.
+        events = event_wait();
+
         now = systick_now();
         
-        switch (fetch_button_state())
+        if ((events & EVENT_BUTTON)!=0)
         {
-            case BUTTON_SHORT:
-                BUTTON_STAT = STAT_BUTTON;
-                usart_printf("Short press...\n");
-                break;
-            case BUTTON_MAINTAINED:
-                led_pattern = LED_PATTERN_FAST;
-                break;
-            case BUTTON_LONG:
-                led_pattern = LED_PATTERN_ON;
-                usart_printf("Long press...\n");
-
-                systick_delay(100);
-
-                usart_printf("Sleeping.");
-
-                go_to_standby_mode();
-                break;
+            sched_at(button_task, now);
         }
 
-        if (i2c_rx_count()!=rx_count)
+        if ((events & EVENT_STATUS)!=0)
         {
-            rx_count = i2c_rx_count();
+            sched_at(leds_task, now);
+            sched_at(lbo_task, now);
+        }
 
-            if (SHADOW_CONF != REGS.CONF)
+        if ((events & EVENT_I2C_RX)!=0)
+        {
+            // Only look at the fields the host actually changed
+            i2c_take_dirty(dirty);
+
+            if (REGS_DIRTY(dirty, CONF))
             {
                 // synchronize here
                 SHADOW_CONF = REGS.CONF;
+                i2c_enable_pec((SHADOW_CONF & CONF_I2C_PEC)!=0);
+                sched_at(watchdog_task, now);
+                sched_at(lbo_task, now);
             }
-
-            if (REGS.PROG != 0)
+            if (REGS_DIRTY(dirty, WATCH))
+                sched_at(watchdog_task, now);
+            if (REGS_DIRTY(dirty, LBO_TIMER))
+                sched_at(lbo_task, now);
+            if (REGS_DIRTY(dirty, INT_ENABLE))
+                configure_int_line();
+            if (REGS_DIRTY(dirty, ADC_CONF))
+                adc_set_low_power((REGS.ADC_CONF & ADC_CONF_LOW_POWER)!=0);
+            if (REGS_DIRTY(dirty, VBAT_FILTER) || REGS_DIRTY(dirty, ADC_CONF))
             {
-                if ((REGS.PROG & PROG_CLEAR_BUTTON) != 0) {
-                    BUTTON_STAT = 0;
-                }
-                if ((REGS.PROG & PROG_CLEAR_ALARM) != 0) {
-                    RTC->ISR &= ~RTC_ISR_ALRAF;
-                }
-                if ((REGS.PROG & PROG_CALENDAR) != 0) {
-                    usart_printf("Calendar update: ");
-                    rtc_disable_write_protection();
-                    if (rtc_enable_calendar_init()==0) {
-                      rtc_set_time(REGS.SET_TIME);
-                      rtc_set_date(REGS.SET_DATE);
-                      rtc_disable_calendar_init();
-                      usart_printf("[OK]\n");
-                    } else {
-                      usart_printf("[FAIL]\n");
-                    }
-                    rtc_enable_write_protection();
-                }
-                if ((REGS.PROG & PROG_ALARM) != 0) {
-                    usart_printf("Alarm update: ");
-                    rtc_disable_write_protection();
-                    rtc_disable_alarm();
-                    rtc_set_alarm(REGS.ALARM);
-                    rtc_enable_alarm();
-                    rtc_enable_write_protection();
-                    usart_printf("[OK]\n");
-                }
+                // start over from the next block, filter_adc() runs in
+                // the DMA interrupt
                 __disable_irq();
-                REGS.PROG = 0;
-                __enable_irq(); 
+                filter_reset(&vbat_filter);
+                __enable_irq();
+            }
+            if (REGS_DIRTY(dirty, VBAT_LOW_MV) || REGS_DIRTY(dirty, VBAT_HIGH_MV)
+                || REGS_DIRTY(dirty, VBAT_CRIT_MV))
+            {
+                save_vbat_levels();
+                run_vbat_watchdog();
+                sched_at(lbo_task, now);
+            }
+
+            // Commands have already been run by PendSV
+            if (REGS.CMD_DONE != cmd_reported)
+            {
+                cmd_reported = REGS.CMD_DONE;
+                usart_printf("Command %i done, status %i\n", cmd_reported, REGS.CMD_STATUS);
+                sched_at(datetime_task, now);
+            }
+
+            // Drop the block in progress and sample faster until a fresh 
+            // one is complete, see filter_adc()
+            if (vbat_sample == VBAT_SAMPLE_REQUESTED)
+            {
+                adc_start(ADC_SAMPLE_RATE);
+                vbat_sample = VBAT_SAMPLE_RUNNING;
+                sampling = 1;
             }
 
             if ((SHADOW_CONF & CONF_I2C_WD)!=0)
                 last_event = now;
         }
 
-        if (i2c_tx_count()!=tx_count)
+        if ((events & EVENT_I2C_ERROR)!=0)
         {
-            tx_count = i2c_tx_count();
-            if ((SHADOW_CONF & CONF_I2C_WD)!=0)
-                last_event = now;
+            REGS.PEC_ERRORS = i2c_pec_errors();
+            REGS.BUS_ERRORS = i2c_error_count(I2C_ERROR_BUS);
+            REGS.ARB_LOST = i2c_error_count(I2C_ERROR_ARBITRATION);
+            REGS.OVERRUNS = i2c_error_count(I2C_ERROR_OVERRUN);
+            REGS.TIMEOUTS = i2c_error_count(I2C_ERROR_TIMEOUT);
         }
 
-        if ((SHADOW_CONF & CONF_PIN_WD)!=0 && gpio_read(GPIO_IN_WATCHDOG)!=0)
+        if ((events & EVENT_ADC)!=0)
         {
-            last_event = now;
+            history_add(REGS.VBAT_MV);
+            REGS.SOC = (soc_update(REGS.VBAT_MV, charger_state()) + 5) / 10;
         }
 
-        update_adc();
-
-        REGS.STAT = stat | BUTTON_STAT;
-
-        update_datetime();
-
-        update_led_patterns(led_pattern);
-
-        if ((SHADOW_CONF & (CONF_I2C_WD | CONF_PIN_WD))!=0)
+        if ((events & EVENT_ADC)!=0 && sampling && vbat_sample == 0)
         {
-            if (now-last_event>(uint32_t)REGS.WATCH*1000)
-            {
-              usart_printf("Going on standby because of watchdog: now=%u last=%u watch=%u\n", now, last_event, REGS.WATCH);    
-              go_to_standby_mode();
-            }
+            adc_start(ADC_RATE);
+            sampling = 0;
         }
-        
-        if ((SHADOW_CONF & CONF_LBO_SHUTDOWN)!=0)
+
+        if ((events & EVENT_ADC_WATCHDOG)!=0)
+            vbat_tripped = 1;
+
+        if ((events & EVENT_ADC)!=0)
         {
-          if (lbo==0)
-          {
-            if ((stat&7)==STAT_STAT2)
+            int level = vbat_level_for(REGS.VBAT_MV);
+
+            if (level == VBAT_CRITICAL && vbat_level != VBAT_CRITICAL)
             {
-              lbo = 1;
-              lbo_start = now;
-              usart_printf("Low battery with programmed shutdown in %us\n", REGS.LBO_TIMER);
+                usart_printf("VBAT below %umV\n", REGS.VBAT_CRIT_MV);
+                raise_interrupt(INT_VBAT_LOW | INT_VBAT_CRIT);
             }
-          }
-          else
-          {
-            if ((stat&7)!=STAT_STAT2)
+            else if (level == VBAT_LOW && vbat_level == VBAT_NORMAL)
             {
-              lbo = 0;
-              usart_printf("Low battery status ended.\n");
+                usart_printf("VBAT below %umV\n", REGS.VBAT_LOW_MV);
+                raise_interrupt(INT_VBAT_LOW);
             }
-            else
+            else if (level == VBAT_NORMAL && vbat_level != VBAT_NORMAL)
+                usart_printf("VBAT back above %umV\n", vbat_restart_mv());
+            if (level != vbat_level || vbat_tripped)
             {
-              if (now-lbo_start>(uint32_t)REGS.LBO_TIMER*1000)
-              {
-                usart_printf("Going on standby because VBAT (%u) too low for %u seconds.\n", REGS.VBAT, REGS.LBO_TIMER);
-                go_to_standby_mode(); 
-              }
+                vbat_level = level;
+                vbat_tripped = 0;
+                run_vbat_watchdog();
+                sched_at(lbo_task, now);
             }
-          }
         }
 
+        if ((events & EVENT_I2C_TX)!=0)
+        {
+            if ((SHADOW_CONF & CONF_I2C_WD)!=0)
+                last_event = now;
+        }
+
+        if ((events & EVENT_WATCHDOG)!=0 && (SHADOW_CONF & CONF_PIN_WD)!=0)
+        {
+            last_event = now;
+        }
+
+        stat = fetch_status() | BUTTON_STAT;
+        check_interrupts(REGS.STAT, stat);
+        REGS.STAT = stat;
+
         if (usart_available())
             process_usart();
+        usart_enable_rx_interrupt();
+
+        // Run the due tasks, then sleep until the earliest deadline
+        next = sched_run(systick_now());
+
+        // Let the host see all the updated registers at once. If it is 
+        // busy reading the previous snapshot, the end of that read, even
+        // an empty or aborted one, wakes us up with EVENT_I2C_RELEASE.
+        if (i2c_publish() == 0)
+            update_int_line();
+
+        systick_set_wakeup(next);
     }
 }
 
@@ -0,0 +1,111 @@
+#ifndef _REGS_H_
+#define _REGS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "i2c_slave.h"
+
+/* Register map served on the I2C address, see main.c. */
+
+typedef struct {
+    // 0
+    uint8_t MODE;   // either 'N' or 'B'
+    uint8_t STAT;   // status
+    uint8_t CONF;   // enable pin WD, etc., commit change
+    uint8_t PROG;   // schedule an operation   
+
+    // 4
+    uint32_t TIME;
+    uint32_t DATE;
+    
+    // 12
+    uint32_t SET_TIME;
+    uint32_t SET_DATE;
+
+    // 20
+    uint16_t WATCH;
+    uint16_t WAKE;
+
+    // 24
+    uint32_t ALARM;
+    uint16_t BOOT;
+    uint16_t FW_VERSION;
+
+    // 32
+    uint16_t VBAT;
+    uint16_t VREF;
+    uint16_t VREF_CAL;
+    uint16_t LBO_TIMER;
+
+    // 40
+    uint8_t CMD_ISSUED; // sequence number of the last PROG command queued
+    uint8_t CMD_DONE;   // sequence number of the last PROG command executed
+    uint8_t CMD_STATUS; // result of command CMD_DONE, 0 on success
+    uint8_t CMD_LOST;   // PROG commands dropped because the queue was full
+
+    // 44
+    uint8_t INT_ENABLE; // events that assert the interrupt line
+    uint8_t INT_CAUSE;  // events since last read, cleared by reading it
+    uint8_t PEC_ERRORS; // writes rejected because of a bad PEC
+    uint8_t RESERVED_47;
+
+    // 48, i2c bus errors, see i2c_slave.h
+    uint8_t BUS_ERRORS; // misplaced START or STOP
+    uint8_t ARB_LOST;   // arbitration lost while transmitting
+    uint8_t OVERRUNS;   // overrun or underrun
+    uint8_t TIMEOUTS;   // bus stuck, i2c peripheral reset
+
+    // 52
+    uint16_t VBAT_MV;   // battery voltage in mV, oversampled and filtered
+    uint8_t VBAT_FILTER;// filter of VBAT_MV, see filter.h
+
+    // 56, analog watchdog on VBAT, see run_vbat_watchdog()
+    uint16_t VBAT_LOW_MV;   // low battery below this, 0 leaves it to the charger
+    uint16_t VBAT_HIGH_MV;  // low battery ends, and the Pi may start, above this
+
+    // 60
+    uint8_t VBAT_SEQ;   // fresh VBAT samples taken on PROG_SAMPLE
+    uint8_t ADC_CONF;   // ADC_CONF_* bits
+    uint8_t RESERVED_62;
+    uint8_t RESERVED_63;
+
+    // 64, internal temperature sensor in 0.1 degC
+    int16_t TEMP;
+    int16_t TEMP_MIN;   // since reset or PROG_CLEAR_TEMP
+    int16_t TEMP_MAX;
+
+    // 70, battery estimates, see soc.h
+    uint8_t SOC;            // state of charge in %
+    uint8_t RESERVED_71;
+    uint16_t TIME_TO_EMPTY; // minutes, 0xFFFF if not discharging or unknown
+    uint16_t TIME_TO_FULL;  // minutes, 0 once charged, 0xFFFF if not charging or unknown
+
+    // 76, analog watchdog on VBAT
+    uint16_t VBAT_CRIT_MV;  // immediate shutdown below this, 0 disables
+
+    // Total size: 80 bytes (73 used)
+} regs_t;
+
+// Fields the host may write, in address order
+#define REGS_WRITABLE(field) \
+    { offsetof(regs_t, field), sizeof(((regs_t *)0)->field) }
+
+static const i2c_range_t REGS_WRITABLE_RANGES[] = {
+    REGS_WRITABLE(CONF),
+    REGS_WRITABLE(PROG),
+    REGS_WRITABLE(SET_TIME),
+    REGS_WRITABLE(SET_DATE),
+    REGS_WRITABLE(WATCH),
+    REGS_WRITABLE(WAKE),
+    REGS_WRITABLE(ALARM),
+    REGS_WRITABLE(VREF_CAL),
+    REGS_WRITABLE(LBO_TIMER),
+    REGS_WRITABLE(INT_ENABLE),
+    REGS_WRITABLE(VBAT_FILTER),
+    REGS_WRITABLE(VBAT_LOW_MV),
+    REGS_WRITABLE(VBAT_HIGH_MV),
+    REGS_WRITABLE(ADC_CONF),
+    REGS_WRITABLE(VBAT_CRIT_MV)
+};
+
+#endif
@@ -1,6 +1,7 @@
 #include "rtc.h"
 #include <stm32f0xx.h>
 #include "gpio.h"
+#include "event.h"
 
 extern inline uint8_t TO_BCD(uint8_t b);
 extern inline uint8_t FROM_BCD(uint8_t b);
@@ -60,6 +61,12 @@ date_t rtc_get_date(void)
     return RTC->DR & ~0xFF0000C0U;
 }
 
+uint32_t rtc_ms_to_next_second(void)
+{
+  // SSR counts down from PREDIV_S to 0 during each second
+  return (((RTC->SSR & 0xFFFF) + 1) * 1000) / (RTC_PREDIV_S + 1);
+}
+
 int rtc_enable_calendar_init(void) 
 {
   uint32_t timeout = 1000000;
@@ -93,6 +100,33 @@ void rtc_disable_alarm(void)
   while ((RTC->ISR & RTC_ISR_ALRAWF) != RTC_ISR_ALRAWF);
 }
 
+void rtc_enable_alarm_interrupt(void)
+{
+  // The RTC alarm reaches the NVIC through EXTI line 17 (rising edge)
+  EXTI->IMR |= EXTI_IMR_MR17;
+  EXTI->RTSR |= EXTI_RTSR_TR17;
+
+  rtc_disable_write_protection();
+  RTC->CR |= RTC_CR_ALRAIE;
+  rtc_enable_write_protection();
+
+  NVIC_EnableIRQ(RTC_IRQn);
+}
+
+void rtc_disable_alarm_interrupt(void)
+{
+  rtc_disable_write_protection();
+  RTC->CR &= ~RTC_CR_ALRAIE;
+  rtc_enable_write_protection();
+}
+
+void RTC_IRQHandler(void)
+{
+  // ALRAF is left alone: it is reported in STAT until the host clears it.
+  EXTI->PR = EXTI_PR_PR17;
+  event_raise(EVENT_RTC);
+}
+
 int rtc_init(void)
 {
     int32_t timeout;
@@ -152,7 +186,7 @@ int rtc_init(void)
       }
 
       // Set clock presacler to asynch = 127 and sync = 255, i.e. div 32767 
-      RTC->PRER = 0x007F00FF;
+      RTC->PRER = (RTC_PREDIV_A<<16) | RTC_PREDIV_S;
 
       // Set hour format to 24h
       RTC->CR &= ~RTC_CR_FMT;
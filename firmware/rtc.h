@@ -2,6 +2,9 @@
 #define _RTC_H_
 #include <stdint.h>
 
+#define RTC_PREDIV_A 0x7F
+#define RTC_PREDIV_S 0xFF
+
 typedef uint32_t time_t;
 
 typedef uint32_t date_t;
@@ -26,6 +29,8 @@ time_t rtc_get_time(void);
 void rtc_set_date(date_t dt);
 date_t rtc_get_date(void);
 
+uint32_t rtc_ms_to_next_second(void);
+
 int rtc_enable_calendar_init(void);
 
 void rtc_disable_calendar_init(void);
@@ -36,6 +41,10 @@ void rtc_enable_alarm(void);
 
 void rtc_disable_alarm(void);
 
+void rtc_enable_alarm_interrupt(void);
+
+void rtc_disable_alarm_interrupt(void);
+
 uint32_t rtc_read_backup_register(uint32_t addr);
 
 void rtc_write_backup_register(uint32_t addr, uint32_t value);
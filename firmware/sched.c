@@ -0,0 +1,86 @@
+#include "sched.h"
+
+/* Cooperative deadline scheduler.
+ *
+ * Tasks are registered once with sched_add() and called from the main 
+ * loop by sched_run() when their deadline is reached. A task with a 
+ * non-zero period is re-armed automatically, a task with a period of 0
+ * runs once and must re-arm itself with sched_at() if needed. A task 
+ * may also override its own next deadline with sched_at() while running.
+ */
+
+typedef struct {
+    sched_task_t task;
+    uint32_t period;
+    uint32_t next;
+    uint8_t active;
+} sched_entry_t;
+
+static sched_entry_t Tasks[SCHED_MAX_TASKS];
+static uint32_t TaskCount;
+
+#define DUE(when, now) ((int32_t)((now)-(when)) >= 0)
+
+int sched_add(sched_task_t task, uint32_t period, uint32_t first_run)
+{
+    sched_entry_t *t;
+
+    if (TaskCount >= SCHED_MAX_TASKS)
+        return -1;
+
+    t = &Tasks[TaskCount];
+    t->task = task;
+    t->period = period;
+    t->next = first_run;
+    t->active = 1;
+
+    return TaskCount++;
+}
+
+void sched_at(int id, uint32_t when)
+{
+    Tasks[id].next = when;
+    Tasks[id].active = 1;
+}
+
+void sched_stop(int id)
+{
+    Tasks[id].active = 0;
+}
+
+uint32_t sched_next(uint32_t now)
+{
+    uint32_t next = now + SCHED_IDLE;
+
+    for (uint32_t i=0; i<TaskCount; i++)
+    {
+        if (Tasks[i].active && (int32_t)(Tasks[i].next - next) < 0)
+            next = Tasks[i].next;
+    }
+    return next;
+}
+
+uint32_t sched_run(uint32_t now)
+{
+    for (uint32_t i=0; i<TaskCount; i++)
+    {
+        sched_entry_t *t = &Tasks[i];
+
+        if (!t->active || !DUE(t->next, now))
+            continue;
+
+        if (t->period != 0)
+        {
+            t->next += t->period;
+            if (DUE(t->next, now))
+                t->next = now + t->period;  // we fell behind, don't try to catch up
+        }
+        else
+        {
+            t->active = 0;
+        }
+
+        t->task(now);
+    }
+    return sched_next(now);
+}
@@ -0,0 +1,24 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+
+#define SCHED_MAX_TASKS 8
+
+// Farthest deadline: sched_next() returns now + SCHED_IDLE when no task
+// is active
+#define SCHED_IDLE      0x7FFFFFFF
+
+typedef void (*sched_task_t)(uint32_t now);
+
+int sched_add(sched_task_t task, uint32_t period, uint32_t first_run);
+
+void sched_at(int id, uint32_t when);
+
+void sched_stop(int id);
+
+uint32_t sched_next(uint32_t now);
+
+uint32_t sched_run(uint32_t now);
+
+#endif
@@ -0,0 +1,116 @@
+#include "soc.h"
+
+/* State of charge of a single Li-ion cell from its voltage.
+ *
+ * The voltage under load is first brought back to an open circuit 
+ * voltage with a fixed offset for the charger state: the charge current 
+ * raises the cell voltage, the load of the Pi lowers it. The state of 
+ * charge is then interpolated in a typical OCV curve.
+ *
+ * The rate of change is the difference between the average state of
+ * charge of a minute and of the one before, low-pass filtered, and 
+ * restarts whenever the charger state changes. Averaging over the minute
+ * keeps the noise of single readings, a few mV where the curve is flat,
+ * out of the rate. Time to empty or to full is the remaining charge divided by
+ * that rate.
+ */
+
+// Cell voltage offsets in mV, internal resistance times typical current
+#define SOC_CHARGE_OFFSET   100     // while charging
+#define SOC_LOAD_OFFSET     60      // while the Pi runs on battery
+
+// Rate filter: 1/2^n per minute, with SOC_RATE_FRAC fraction bits
+#define SOC_RATE_SHIFT      3
+#define SOC_RATE_FRAC       8
+
+// Minutes of rate tracking before the estimates are published
+#define SOC_RATE_MINUTES    3
+
+// Open circuit voltage in mV at 0 %, 10 %, ... 100 %
+static const uint16_t SOC_OCV[11] = {
+    3300, 3680, 3740, 3770, 3790, 3820, 3870, 3920, 3980, 4060, 4180
+};
+
+static uint32_t soc_now;        // last state of charge, 0.1 %
+static uint32_t soc_sum;        // of the current minute
+static uint32_t soc_count;
+static uint32_t soc_last;       // average of the previous minute
+static int soc_state = -1;
+static int32_t soc_rate;        // 0.1 % per minute, SOC_RATE_FRAC bits
+static uint32_t soc_minutes;    // of rate tracking in soc_state
+
+static uint32_t soc_lookup(uint32_t mv)
+{
+    uint32_t i;
+
+    if (mv <= SOC_OCV[0])
+        return 0;
+    for (i=1; i<11; i++)
+    {
+        if (mv < SOC_OCV[i])
+            return 100*(i-1) + 100*(mv - SOC_OCV[i-1]) / (SOC_OCV[i] - SOC_OCV[i-1]);
+    }
+    return 1000;
+}
+
+uint32_t soc_update(uint32_t mv, int state)
+{
+    if (state == SOC_CHARGING)
+        mv = mv > SOC_CHARGE_OFFSET ? mv - SOC_CHARGE_OFFSET : 0;
+    else if (state == SOC_DISCHARGING)
+        mv += SOC_LOAD_OFFSET;
+
+    soc_now = soc_lookup(mv);
+    if (state != soc_state)
+    {
+        soc_state = state;
+        soc_minutes = 0;
+        soc_sum = soc_count = 0;
+    }
+    soc_sum += soc_now;
+    soc_count++;
+    return soc_now;
+}
+
+void soc_minute(void)
+{
+    uint32_t avg = soc_count ? (soc_sum + soc_count/2) / soc_count : soc_now;
+    int32_t delta = ((int32_t)avg - (int32_t)soc_last) << SOC_RATE_FRAC;
+
+    soc_last = avg;
+    soc_sum = soc_count = 0;
+    if (soc_minutes == 0)
+        soc_rate = 0;           // soc_last was from another state
+    else if (soc_minutes == 1)
+        soc_rate = delta;
+    else
+        soc_rate += (delta - soc_rate) >> SOC_RATE_SHIFT;
+    if (soc_minutes < SOC_RATE_MINUTES)
+        soc_minutes++;
+}
+
+static uint32_t soc_minutes_for(uint32_t charge, int32_t rate)
+{
+    uint32_t minutes;
+
+    if (soc_minutes < SOC_RATE_MINUTES || rate <= 0)
+        return SOC_UNKNOWN;
+    minutes = (charge << SOC_RATE_FRAC) / rate;
+    return minutes < SOC_UNKNOWN ? minutes : SOC_UNKNOWN-1;
+}
+
+uint32_t soc_time_to_empty(void)
+{
+    if (soc_state != SOC_DISCHARGING)
+        return SOC_UNKNOWN;
+    return soc_minutes_for(soc_now, -soc_rate);
+}
+
+uint32_t soc_time_to_full(void)
+{
+    if (soc_state == SOC_FULL)
+        return 0;
+    if (soc_state != SOC_CHARGING)
+        return SOC_UNKNOWN;
+    return soc_minutes_for(1000 - soc_now, soc_rate);
+}
@@ -0,0 +1,25 @@
+#ifndef _SOC_H_
+#define _SOC_H_
+
+#include <stdint.h>
+
+// Charger states, for the load compensation
+#define SOC_IDLE            0   // on external power, not charging (fault, no battery)
+#define SOC_CHARGING        1
+#define SOC_DISCHARGING     2
+#define SOC_FULL            3   // on external power, charge complete
+
+// Time returned when there is no estimate yet, or none makes sense
+#define SOC_UNKNOWN         0xFFFF
+
+// Feed a battery voltage in mV, returns the state of charge in 0.1 %
+uint32_t soc_update(uint32_t mv, int state);
+
+// Called once a minute, tracks the rate of change of the state of charge
+void soc_minute(void);
+
+// Estimates in minutes, from the tracked rate
+uint32_t soc_time_to_empty(void);
+uint32_t soc_time_to_full(void);
+
+#endif
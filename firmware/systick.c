@@ -1,38 +1,122 @@
 #include <stm32f0xx.h>
 #include "systick.h"
+#include "event.h"
 //#include "usart.h"
 
-static __IO uint32_t TimingDelay;
-static __IO uint32_t Now;
+/* Tickless timebase.
+ *
+ * TIM14 counts milliseconds freely and only interrupts on overflow 
+ * (every 65.5s), to extend the count to 32 bits, and on the compare 
+ * match programmed by systick_set_wakeup(). The module keeps its 
+ * historical name and API.
+ */
 
+static __IO uint32_t Epoch;
 
 void systick_init()
 {
     SystemCoreClockUpdate();
 
-    Now = 0;
+    Epoch = 0;
 
-    if (SysTick_Config(SystemCoreClock / 1000)) for(;;);
+    // We don't want the 1ms SysTick interrupt anymore
+    SysTick->CTRL = 0;
+
+    RCC->APB1ENR |= RCC_APB1ENR_TIM14EN;
+
+    TIM14->PSC = (SystemCoreClock / 1000) - 1;  // 1 kHz
+    TIM14->ARR = 0xFFFF;
+    TIM14->CNT = 0;
+    TIM14->EGR = TIM_EGR_UG;                    // load prescaler
+    TIM14->SR = 0;
+    TIM14->DIER = TIM_DIER_UIE;
+    TIM14->CR1 = TIM_CR1_CEN;
+
+    NVIC_EnableIRQ(TIM14_IRQn);
 
     //usart_printf("\nSystemCoreClock=%u\n",SystemCoreClock);
 }
 
+void systick_set_wakeup(uint32_t when)
+{
+    int32_t delta = (int32_t)(when - systick_now());
+
+    TIM14->DIER &= ~TIM_DIER_CC1IE;
+
+    if (delta <= 0)
+    {
+        event_raise(EVENT_TICK);
+        return;
+    }
+
+    // Deadlines beyond the counter range are handled by the overflow 
+    // interrupt, which always comes first.
+    if (delta > 0xFFFF)
+        return;
+
+    TIM14->CCR1 = when & 0xFFFF;
+    TIM14->SR = ~TIM_SR_CC1IF;
+    TIM14->DIER |= TIM_DIER_CC1IE;
+
+    // The deadline may have passed while we were programming CCR1
+    if ((int32_t)(when - systick_now()) <= 0)
+        event_raise(EVENT_TICK);
+}
+
 void systick_delay(uint32_t delay_ms)
 {
-    TimingDelay = delay_ms;
-    while(TimingDelay != 0);
+    uint32_t start = systick_now();
+
+    while ((systick_now() - start) < delay_ms)
+    {
+        // See event_wait(): WFI returns on a pending interrupt even
+        // with PRIMASK set.
+        __disable_irq();
+        systick_set_wakeup(start + delay_ms);
+        if ((systick_now() - start) < delay_ms)
+            __WFI();
+        __enable_irq();
+    }
 }
 
 uint32_t systick_now()
 {
-    return Now;
+    uint32_t primask = __get_PRIMASK();
+    uint32_t epoch, count;
+
+    __disable_irq();
+    epoch = Epoch;
+    count = TIM14->CNT;
+    if ((TIM14->SR & TIM_SR_UIF) != 0)
+    {
+        // Overflow not serviced yet: the counter must be read again as
+        // we can't tell if the first read came before or after it.
+        epoch += 0x10000;
+        count = TIM14->CNT;
+    }
+    __set_PRIMASK(primask);
+
+    return epoch | count;
 }
 
-void SysTick_Handler(void)
+void TIM14_IRQHandler(void)
 {
-    if (TimingDelay != 0x00)
-        TimingDelay --;
-    Now++;
+    uint32_t sr = TIM14->SR;
+
+    if ((sr & TIM_SR_UIF) != 0)
+    {
+        TIM14->SR = ~TIM_SR_UIF;
+        Epoch += 0x10000;
+        // let the main loop reprogram deadlines that were out of range
+        event_raise(EVENT_TICK);
+    }
+
+    if ((sr & TIM_SR_CC1IF) != 0 && (TIM14->DIER & TIM_DIER_CC1IE) != 0)
+    {
+        TIM14->SR = ~TIM_SR_CC1IF;
+        TIM14->DIER &= ~TIM_DIER_CC1IE;
+        event_raise(EVENT_TICK);
+    }
 }
 
 void active_delay(uint32_t delay_ms)
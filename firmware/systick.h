@@ -7,6 +7,9 @@ void systick_delay(uint32_t delay_ms);
 
 uint32_t systick_now();
 
+// Raise EVENT_TICK once systick_now() reaches 'when' (single deadline)
+void systick_set_wakeup(uint32_t when);
+
 void active_delay(uint32_t delay_ms);
 
 #endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Writable ranges of regs.h against the per-byte write mask they
+ * replaced.
+ *
+ * i2c_slave.c is built in here, in byte mode, to reach its static
+ * i2c_rx_end(). Writes are first played through I2C1_IRQHandler to check
+ * that only the fields of REGS_WRITABLE_RANGES are applied. Then the
+ * commit of a write as long as the staging buffer takes, and of a 
+ * one-field write, is timed against the old i2c_rx_end() over a
+ * regs_t-sized mask.
+ *
+ * The times are host nanoseconds, not M0 cycles: they only rank the two
+ * schemes. Both read one byte of table per register byte, the bitmap
+ * built by i2c_set_writable() or the mask, so they should cost about
+ * the same on the M0 too. What the ranges save is flash.
+ */
+#include "../i2c_slave.c"
+#include "regs.h"
+
+#define REGS_SIZE   sizeof(regs_t)
+#define WRITE_LEN   (I2C_RX_BUF_SIZE-1)    // longest write the staging buffer takes
+#define RUNS        200000
+
+#define RANGE_COUNT (sizeof(REGS_WRITABLE_RANGES)/sizeof(REGS_WRITABLE_RANGES[0]))
+
+static uint8_t regs[REGS_SIZE];
+static uint8_t mask[REGS_SIZE];
+
+static void irq(uint32_t isr)
+{
+    I2C1->ISR = isr;
+    I2C1_IRQHandler();
+}
+
+static void host_write(uint8_t reg, const uint8_t *data, uint32_t len)
+{
+    irq(I2C_ISR_ADDR | (0x69u<<17));
+    I2C1->RXDR = reg;
+    irq(I2C_ISR_RXNE);
+    for (uint32_t i=0; i<len; i++)
+    {
+        I2C1->RXDR = data[i];
+        irq(I2C_ISR_RXNE);
+    }
+    irq(I2C_ISR_STOPF);
+}
+
+// i2c_rx_end() as it was with the write mask
+static void mask_rx_end(uint32_t stop)
+{
+    uint8_t *image = i2c_images ? i2c_images + i2c_front*i2c_buf_len : 0;
+    uint8_t m, data, value;
+    uint32_t start;
+    uint32_t len = i2c_rx_len;
+    uint32_t i = i2c_wide ? 2 : 1;
+
+    i2c_rx_len = 0;
+    if (i2c_pec_enabled && len>0)
+        len = i2c_rx_check(len, stop);
+    if (len < i)
+        return;
+
+    start = i2c_reg = i2c_wide ? (i2c_rx_buf[0]<<8) | i2c_rx_buf[1] : i2c_rx_buf[0];
+    for (; i<len; i++)
+    {
+        if (i2c_reg >= i2c_buf_len)
+        {
+            if (i2c_region_write(i2c_reg, i2c_rx_buf[i]) < 0)
+                break;
+            i2c_reg++;
+            continue;
+        }
+        m = mask[i2c_reg];
+        data = i2c_rx_buf[i] & m;
+        value = (i2c_buf[i2c_reg] & ~m) | data;
+        if (value != i2c_buf[i2c_reg] && (i2c_reg>>5) < I2C_DIRTY_WORDS)
+            i2c_dirty[i2c_reg>>5] |= 1<<(i2c_reg&31);
+        i2c_buf[i2c_reg] = value;
+        if (image)
+            image[i2c_reg] = (image[i2c_reg] & ~m) | data;
+        i2c_reg++;
+    }
+
+    if (i2c_write_handler && i2c_reg>start)
+        i2c_write_handler(start, i2c_reg-start);
+
+    i2c_commits++;
+    i2c_buf_rx_count++;
+    event_raise(EVENT_I2C_RX);
+}
+
+static void stage(uint8_t reg, uint8_t fill, uint32_t len)
+{
+    i2c_rx_buf[0] = reg;
+    memset(i2c_rx_buf+1, fill, len);
+    i2c_rx_len = len+1;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static double bench(void (*commit)(uint32_t), uint8_t reg, uint32_t len)
+{
+    double start = now_ns();
+
+    for (uint32_t n=0; n<RUNS; n++)
+    {
+        stage(reg, n, len);
+        commit(1);
+    }
+    return (now_ns()-start) / ((double)RUNS*len);
+}
+
+int main(void)
+{
+    uint8_t data[REGS_SIZE];
+    uint32_t dirty[I2C_DIRTY_WORDS];
+    uint8_t expect[REGS_SIZE];
+    double t_mask, t_ranges;
+    int fail = 0;
+
+    for (uint32_t r=0; r<RANGE_COUNT; r++)
+        memset(mask+REGS_WRITABLE_RANGES[r].start, 0xFF, REGS_WRITABLE_RANGES[r].len);
+
+    i2c_set_buffer(regs, REGS_SIZE);
+    i2c_set_writable(REGS_WRITABLE_RANGES, RANGE_COUNT);
+
+    // Whole map written: only the ranges change, and are marked dirty
+    memset(data, 0xA5, sizeof(data));
+    host_write(0, data, REGS_SIZE/2);
+    host_write(REGS_SIZE/2, data, REGS_SIZE/2);
+    i2c_take_dirty(dirty);
+    for (uint32_t i=0; i<REGS_SIZE; i++)
+    {
+        expect[i] = mask[i] ? 0xA5 : 0;
+        if (regs[i] != expect[i] || ((dirty[i>>5]>>(i&31)) & 1) != (mask[i] ? 1u : 0u))
+        {
+            printf("FAIL: byte %u is %02x, dirty %u\n", i, regs[i], (dirty[i>>5]>>(i&31)) & 1);
+            fail = 1;
+        }
+    }
+
+    // A write starting inside the map, across read-only bytes
+    memset(data, 0x3C, sizeof(data));
+    host_write(21, data, 20);
+    for (uint32_t i=21; i<41; i++)
+        expect[i] = mask[i] ? 0x3C : expect[i];
+    if (memcmp(regs, expect, REGS_SIZE) != 0)
+    {
+        printf("FAIL: partial write\n");
+        fail = 1;
+    }
+    if (i2c_rx_count() != 3)
+    {
+        printf("FAIL: %u writes counted\n", i2c_rx_count());
+        fail = 1;
+    }
+
+    t_mask = bench(mask_rx_end, 0, WRITE_LEN);
+    t_ranges = bench(i2c_rx_end, 0, WRITE_LEN);
+    printf("commit per byte, %u-byte write: mask %.2f ns, ranges %.2f ns (host, not M0)\n",
+        WRITE_LEN, t_mask, t_ranges);
+    // The usual write: one field, here VBAT_CRIT_MV
+    t_mask = bench(mask_rx_end, offsetof(regs_t, VBAT_CRIT_MV), 2);
+    t_ranges = bench(i2c_rx_end, offsetof(regs_t, VBAT_CRIT_MV), 2);
+    printf("commit per byte, 2-byte write: mask %.2f ns, ranges %.2f ns (host, not M0)\n",
+        t_mask, t_ranges);
+    printf("flash: mask %u bytes, ranges %u bytes\n", (uint32_t)REGS_SIZE,
+        (uint32_t)sizeof(REGS_WRITABLE_RANGES));
+
+    return fail;
+}
@@ -0,0 +1,286 @@
+/* Host stand-in for the CMSIS device header, for the tests only. Names
+ * mirror CMSIS, bit values are dummies, register blocks are plain memory 
+ * (see stub.c) and __WFI() calls stub_wfi, which a test may set to move
+ * simulated time forward.
+ */
+#ifndef STUB_STM32F0XX_H
+#define STUB_STM32F0XX_H
+#include <stdint.h>
+#define __IO volatile
+#define __I volatile const
+typedef enum { WWDG_IRQn, RTC_IRQn=2, EXTI0_1_IRQn=5, EXTI2_3_IRQn, EXTI4_15_IRQn, DMA1_Channel1_IRQn=9, DMA1_Channel2_3_IRQn, DMA1_Channel4_5_IRQn, ADC1_IRQn, TIM1_BRK_UP_TRG_COM_IRQn, TIM3_IRQn=16, TIM14_IRQn=19, TIM16_IRQn=21, TIM17_IRQn, I2C1_IRQn=23, USART1_IRQn=27, PendSV_IRQn=-2, SysTick_IRQn=-1 } IRQn_Type;
+static inline void NVIC_SetPriority(IRQn_Type i, uint32_t p){(void)i;(void)p;}
+static inline void NVIC_EnableIRQ(IRQn_Type i){(void)i;}
+static inline void NVIC_DisableIRQ(IRQn_Type i){(void)i;}
+static inline void NVIC_ClearPendingIRQ(IRQn_Type i){(void)i;}
+static inline void NVIC_SetPendingIRQ(IRQn_Type i){(void)i;}
+extern void (*stub_wfi)(void);
+static inline void __WFI(void){ if (stub_wfi) stub_wfi(); }
+static inline void __WFE(void){}
+static inline void __SEV(void){}
+static inline void __NOP(void){}
+static inline void __DSB(void){}
+static inline void __ISB(void){}
+static inline void __disable_irq(void){}
+static inline void __enable_irq(void){}
+static inline uint32_t __get_PRIMASK(void){return 0;}
+static inline void __set_PRIMASK(uint32_t p){(void)p;}
+static inline uint32_t SysTick_Config(uint32_t t){(void)t;return 0;}
+extern uint32_t SystemCoreClock; void SystemCoreClockUpdate(void);
+typedef struct { __IO uint32_t CPUID, ICSR, RESERVED0, AIRCR, SCR, CCR, RESERVED1, SHP[2], SHCSR; } SCB_Type;
+typedef struct { __IO uint32_t CTRL, LOAD, VAL, CALIB; } SysTick_Type;
+extern SCB_Type *SCB; extern SysTick_Type *SysTick;
+#define SCB_SCR_SLEEPDEEP_Msk (1u<<2)
+#define SCB_SCR_SLEEPONEXIT_Msk (1u<<1)
+#define SCB_ICSR_PENDSVSET_Msk (1u<<28)
+#define SCB_ICSR_PENDSVCLR_Msk (1u<<27)
+#define SysTick_CTRL_ENABLE_Msk 1u
+#define SysTick_CTRL_TICKINT_Msk 2u
+#define SysTick_CTRL_CLKSOURCE_Msk 4u
+#define SysTick_CTRL_COUNTFLAG_Msk (1u<<16)
+typedef struct { __IO uint32_t CR, CFGR, CIR, APB2RSTR, APB1RSTR, AHBENR, APB2ENR, APB1ENR, BDCR, CSR, AHBRSTR, CFGR2, CFGR3, CR2; } RCC_TypeDef;
+typedef struct { __IO uint32_t MODER, OTYPER, OSPEEDR, PUPDR, IDR, ODR, BSRR, LCKR, AFR[2], BRR; } GPIO_TypeDef;
+typedef struct { __IO uint32_t CR1, CR2, OAR1, OAR2, TIMINGR, TIMEOUTR, ISR, ICR, PECR, RXDR, TXDR; } I2C_TypeDef;
+typedef struct { __IO uint32_t CCR, CNDTR, CPAR, CMAR; } DMA_Channel_TypeDef;
+typedef struct { __IO uint32_t ISR, IFCR; } DMA_TypeDef;
+typedef struct { __IO uint32_t ISR, IER, CR, CFGR1, CFGR2, SMPR, RESERVED1, RESERVED2, TR, RESERVED3, CHSELR, RESERVED4[5], DR; } ADC_TypeDef;
+typedef struct { __IO uint32_t CCR; } ADC_Common_TypeDef;
+typedef struct { __IO uint32_t CR1, CR2, SMCR, DIER, SR, EGR, CCMR1, CCMR2, CCER, CNT, PSC, ARR, RCR, CCR1, CCR2, CCR3, CCR4, BDTR, DCR, DMAR, OR; } TIM_TypeDef;
+typedef struct { __IO uint32_t TR, DR, CR, ISR, PRER, RESERVED1, RESERVED2, WPR, SSR, SHIFTR, TSTR, TSDR, TSSSR, CALR, TAFCR, ALRMAR, RESERVED3, ALRMASSR, RESERVED4, BKP0R, BKP1R, BKP2R, BKP3R, BKP4R; } RTC_TypeDef;
+typedef struct { __IO uint32_t CR, CSR; } PWR_TypeDef;
+typedef struct { __IO uint32_t IMR, EMR, RTSR, FTSR, SWIER, PR; } EXTI_TypeDef;
+typedef struct { __IO uint32_t CFGR1, RESERVED, EXTICR[4], CFGR2; } SYSCFG_TypeDef;
+typedef struct { __IO uint32_t CR1, CR2, CR3, BRR, GTPR, RTOR, RQR, ISR, ICR; __IO uint16_t RDR, r1, TDR, r2; } USART_TypeDef;
+typedef struct { __IO uint32_t ACR, KEYR, OPTKEYR, SR, CR, AR, RESERVED, OBR, WRPR; } FLASH_TypeDef;
+extern RCC_TypeDef *RCC; extern I2C_TypeDef *I2C1; extern DMA_TypeDef *DMA1;
+extern DMA_Channel_TypeDef *DMA1_Channel1, *DMA1_Channel2, *DMA1_Channel3, *DMA1_Channel4, *DMA1_Channel5;
+extern ADC_TypeDef *ADC1; extern ADC_Common_TypeDef *ADC; extern TIM_TypeDef *TIM1, *TIM3, *TIM14, *TIM16, *TIM17;
+extern RTC_TypeDef *RTC; extern PWR_TypeDef *PWR; extern EXTI_TypeDef *EXTI; extern SYSCFG_TypeDef *SYSCFG;
+extern USART_TypeDef *USART1, *USART4; extern GPIO_TypeDef *GPIOA, *GPIOB, *GPIOC; extern FLASH_TypeDef *FLASH;
+extern uint8_t stub_gpio[3*0x400];
+#define AHB2PERIPH_BASE ((uintptr_t)stub_gpio)
+#define B(n) (1u<<(n))
+/* RCC */
+#define RCC_AHBENR_GPIOAEN B(17)
+#define RCC_AHBENR_GPIOBEN B(18)
+#define RCC_AHBENR_GPIOCEN B(19)
+#define RCC_AHBENR_DMA1EN B(0)
+#define RCC_AHBENR_DMAEN B(0)
+#define RCC_APB1ENR_I2C1EN B(21)
+#define RCC_APB1ENR_PWREN B(28)
+#define RCC_APB1ENR_TIM3EN B(1)
+#define RCC_APB1ENR_TIM14EN B(8)
+#define RCC_APB1ENR_USART4EN B(19)
+#define RCC_APB1RSTR_I2C1RST B(21)
+#define RCC_APB2ENR_ADC1EN B(9)
+#define RCC_APB2ENR_USART1EN B(14)
+#define RCC_APB2ENR_SYSCFGEN B(0)
+#define RCC_APB2ENR_SYSCFGCOMPEN B(0)
+#define RCC_APB2ENR_TIM16EN B(17)
+#define RCC_APB2ENR_TIM17EN B(18)
+#define RCC_CR2_HSI14ON B(0)
+#define RCC_CR2_HSI14RDY B(1)
+#define RCC_CR2_HSI14DIS B(2)
+#define RCC_CFGR3_I2C1SW B(4)
+#define RCC_BDCR_BDRST B(16)
+#define RCC_BDCR_LSEDRV_0 B(3)
+#define RCC_BDCR_LSEDRV_1 B(4)
+#define RCC_BDCR_LSEON B(0)
+#define RCC_BDCR_LSERDY B(1)
+#define RCC_BDCR_RTCSEL (3u<<8)
+#define RCC_BDCR_RTCSEL_LSE B(8)
+#define RCC_BDCR_RTCEN B(15)
+#define RCC_CSR_RMVF B(24)
+/* PWR */
+#define PWR_CR_CWUF B(2)
+#define PWR_CR_CSBF B(3)
+#define PWR_CR_PDDS B(1)
+#define PWR_CR_LPDS B(0)
+#define PWR_CR_DBP B(8)
+#define PWR_CSR_SBF B(1)
+#define PWR_CSR_EWUP1 B(8)
+#define PWR_CSR_EWUP2 B(9)
+/* I2C */
+#define I2C_CR1_PE B(0)
+#define I2C_CR1_TXIE B(1)
+#define I2C_CR1_RXIE B(2)
+#define I2C_CR1_ADDRIE B(3)
+#define I2C_CR1_NACKIE B(4)
+#define I2C_CR1_STOPIE B(5)
+#define I2C_CR1_TCIE B(6)
+#define I2C_CR1_ERRIE B(7)
+#define I2C_CR1_DNF (0xFu<<8)
+#define I2C_CR1_ANFOFF B(12)
+#define I2C_CR1_TXDMAEN B(14)
+#define I2C_CR1_RXDMAEN B(15)
+#define I2C_CR1_SBC B(16)
+#define I2C_CR1_NOSTRETCH B(17)
+#define I2C_CR1_SMBHEN B(20)
+#define I2C_CR1_SMBDEN B(21)
+#define I2C_CR1_PECEN B(23)
+#define I2C_CR2_NACK B(15)
+#define I2C_CR2_PECBYTE B(26)
+#define I2C_OAR1_OA1EN B(15)
+#define I2C_OAR1_OA1 0x3FFu
+#define I2C_ISR_TXE B(0)
+#define I2C_ISR_TXIS B(1)
+#define I2C_ISR_RXNE B(2)
+#define I2C_ISR_ADDR B(3)
+#define I2C_ISR_NACKF B(4)
+#define I2C_ISR_STOPF B(5)
+#define I2C_ISR_TC B(6)
+#define I2C_ISR_TCR B(7)
+#define I2C_ISR_BERR B(8)
+#define I2C_ISR_ARLO B(9)
+#define I2C_ISR_OVR B(10)
+#define I2C_ISR_PECERR B(11)
+#define I2C_ISR_TIMEOUT B(12)
+#define I2C_ISR_BUSY B(15)
+#define I2C_ISR_DIR B(16)
+#define I2C_ISR_ADDCODE (0x7Fu<<17)
+#define I2C_ICR_ADDRCF B(3)
+#define I2C_ICR_NACKCF B(4)
+#define I2C_ICR_STOPCF B(5)
+#define I2C_ICR_BERRCF B(8)
+#define I2C_ICR_ARLOCF B(9)
+#define I2C_ICR_OVRCF B(10)
+#define I2C_ICR_PECCF B(11)
+#define I2C_ICR_TIMOUTCF B(12)
+#define I2C_TIMEOUTR_TIMEOUTA 0xFFFu
+#define I2C_TIMEOUTR_TIMOUTEN B(15)
+/* SYSCFG */
+#define SYSCFG_CFGR1_I2C_FMP_PB8 B(18)
+#define SYSCFG_CFGR1_I2C_FMP_PB9 B(19)
+#define SYSCFG_CFGR1_I2C_FMP_I2C1 B(20)
+#define SYSCFG_EXTICR4_EXTI13 (0xFu<<4)
+#define SYSCFG_EXTICR4_EXTI13_PC (0x2u<<4)
+#define SYSCFG_EXTICR1_EXTI0 (0xFu)
+#define SYSCFG_EXTICR1_EXTI0_PA (0u)
+/* EXTI */
+#define EXTI_IMR_MR0 B(0)
+#define EXTI_IMR_MR13 B(13)
+#define EXTI_IMR_MR17 B(17)
+#define EXTI_RTSR_TR0 B(0)
+#define EXTI_RTSR_TR13 B(13)
+#define EXTI_RTSR_TR17 B(17)
+#define EXTI_FTSR_TR0 B(0)
+#define EXTI_FTSR_TR13 B(13)
+#define EXTI_PR_PR0 B(0)
+#define EXTI_PR_PR13 B(13)
+#define EXTI_PR_PR17 B(17)
+/* DMA */
+#define DMA_CCR_EN B(0)
+#define DMA_CCR_TCIE B(1)
+#define DMA_CCR_HTIE B(2)
+#define DMA_CCR_TEIE B(3)
+#define DMA_CCR_DIR B(4)
+#define DMA_CCR_CIRC B(5)
+#define DMA_CCR_PINC B(6)
+#define DMA_CCR_MINC B(7)
+#define DMA_CCR_PSIZE_0 B(8)
+#define DMA_CCR_MSIZE_0 B(10)
+#define DMA_CCR_PL_0 B(12)
+#define DMA_CCR_PL_1 B(13)
+#define DMA_ISR_GIF1 B(0)
+#define DMA_ISR_TCIF1 B(1)
+#define DMA_ISR_HTIF1 B(2)
+#define DMA_ISR_TEIF1 B(3)
+#define DMA_ISR_GIF2 B(4)
+#define DMA_ISR_TCIF2 B(5)
+#define DMA_ISR_TEIF2 B(7)
+#define DMA_ISR_GIF3 B(8)
+#define DMA_ISR_TCIF3 B(9)
+#define DMA_ISR_TEIF3 B(11)
+#define DMA_IFCR_CGIF1 B(0)
+#define DMA_IFCR_CTCIF1 B(1)
+#define DMA_IFCR_CHTIF1 B(2)
+#define DMA_IFCR_CGIF2 B(4)
+#define DMA_IFCR_CTCIF2 B(5)
+#define DMA_IFCR_CGIF3 B(8)
+#define DMA_IFCR_CTCIF3 B(9)
+/* ADC */
+#define ADC_ISR_ADRDY B(0)
+#define ADC_ISR_EOSMP B(1)
+#define ADC_ISR_EOC B(2)
+#define ADC_ISR_EOSEQ B(3)
+#define ADC_ISR_OVR B(4)
+#define ADC_ISR_AWD B(7)
+#define ADC_IER_ADRDYIE B(0)
+#define ADC_IER_EOCIE B(2)
+#define ADC_IER_EOSEQIE B(3)
+#define ADC_IER_OVRIE B(4)
+#define ADC_IER_AWDIE B(7)
+#define ADC_CR_ADEN B(0)
+#define ADC_CR_ADDIS B(1)
+#define ADC_CR_ADSTART B(2)
+#define ADC_CR_ADSTP B(4)
+#define ADC_CR_ADCAL B(31)
+#define ADC_CFGR1_DMAEN B(0)
+#define ADC_CFGR1_DMACFG B(1)
+#define ADC_CFGR1_SCANDIR B(2)
+#define ADC_CFGR1_RES (3u<<3)
+#define ADC_CFGR1_ALIGN B(5)
+#define ADC_CFGR1_EXTSEL (7u<<6)
+#define ADC_CFGR1_EXTSEL_0 B(6)
+#define ADC_CFGR1_EXTSEL_1 B(7)
+#define ADC_CFGR1_EXTSEL_2 B(8)
+#define ADC_CFGR1_EXTEN (3u<<10)
+#define ADC_CFGR1_EXTEN_0 B(10)
+#define ADC_CFGR1_OVRMOD B(12)
+#define ADC_CFGR1_CONT B(13)
+#define ADC_CFGR1_WAIT B(14)
+#define ADC_CFGR1_AUTOFF B(15)
+#define ADC_CFGR1_DISCEN B(16)
+#define ADC_CFGR1_AWDSGL B(22)
+#define ADC_CFGR1_AWDEN B(23)
+#define ADC_CFGR1_AWDCH (0x1Fu<<26)
+#define ADC_CFGR1_AWDCH_1 B(27)
+#define ADC_CFGR1_AWDCH_2 B(28)
+#define ADC_CFGR2_CKMODE (3u<<30)
+#define ADC_SMPR_SMP_0 B(0)
+#define ADC_SMPR_SMP_1 B(1)
+#define ADC_SMPR_SMP_2 B(2)
+#define ADC_SMPR_SMP (7u)
+#define ADC_TR_HT (0xFFFu<<16)
+#define ADC_TR_LT 0xFFFu
+#define ADC_CHSELR_CHSEL6 B(6)
+#define ADC_CHSELR_CHSEL16 B(16)
+#define ADC_CHSELR_CHSEL17 B(17)
+#define ADC_CCR_VREFEN B(22)
+#define ADC_CCR_TSEN B(23)
+/* TIM */
+#define TIM_CR1_CEN B(0)
+#define TIM_CR1_UDIS B(1)
+#define TIM_CR1_URS B(2)
+#define TIM_CR1_OPM B(3)
+#define TIM_CR1_ARPE B(7)
+#define TIM_CR2_MMS (7u<<4)
+#define TIM_CR2_MMS_1 B(5)
+#define TIM_DIER_UIE B(0)
+#define TIM_DIER_CC1IE B(1)
+#define TIM_SR_UIF B(0)
+#define TIM_SR_CC1IF B(1)
+#define TIM_EGR_UG B(0)
+#define TIM_DBGMCU_STOP B(0)
+/* RTC */
+#define RTC_ISR_ALRAWF B(0)
+#define RTC_ISR_INITS B(4)
+#define RTC_ISR_RSF B(5)
+#define RTC_ISR_INITF B(6)
+#define RTC_ISR_INIT B(7)
+#define RTC_ISR_ALRAF B(8)
+#define RTC_CR_FMT B(6)
+#define RTC_CR_ALRAE B(8)
+#define RTC_CR_ALRAIE B(12)
+/* USART */
+#define USART_CR1_UE B(0)
+#define USART_CR1_RE B(2)
+#define USART_CR1_TE B(3)
+#define USART_CR1_RXNEIE B(5)
+#define USART_ISR_RXNE B(5)
+#define USART_ISR_TXE B(7)
+#define USART_ISR_ORE B(3)
+#define USART_ICR_ORECF B(3)
+#define USART_CR3_OVRDIS B(12)
+#endif
+#define I2C_OAR2_OA2EN B(15)
@@ -0,0 +1,46 @@
+#include "stm32f0xx.h"
+
+/* Register blocks of the host stand-in, see stm32f0xx.h */
+
+void (*stub_wfi)(void);
+uint32_t SystemCoreClock = 48000000;
+uint8_t stub_gpio[3*0x400];
+
+static SCB_Type scb;
+static SysTick_Type systick;
+static RCC_TypeDef rcc;
+static I2C_TypeDef i2c1;
+static DMA_TypeDef dma1;
+static DMA_Channel_TypeDef dma1_ch[5];
+static ADC_TypeDef adc1;
+static ADC_Common_TypeDef adc;
+static TIM_TypeDef tim[5];
+static RTC_TypeDef rtc;
+static PWR_TypeDef pwr;
+static EXTI_TypeDef exti;
+static SYSCFG_TypeDef syscfg;
+static USART_TypeDef usart[2];
+static FLASH_TypeDef flash;
+
+SCB_Type *SCB = &scb;
+SysTick_Type *SysTick = &systick;
+RCC_TypeDef *RCC = &rcc;
+I2C_TypeDef *I2C1 = &i2c1;
+DMA_TypeDef *DMA1 = &dma1;
+DMA_Channel_TypeDef *DMA1_Channel1 = &dma1_ch[0], *DMA1_Channel2 = &dma1_ch[1],
+    *DMA1_Channel3 = &dma1_ch[2], *DMA1_Channel4 = &dma1_ch[3], *DMA1_Channel5 = &dma1_ch[4];
+ADC_TypeDef *ADC1 = &adc1;
+ADC_Common_TypeDef *ADC = &adc;
+TIM_TypeDef *TIM1 = &tim[0], *TIM3 = &tim[1], *TIM14 = &tim[2], *TIM16 = &tim[3], *TIM17 = &tim[4];
+RTC_TypeDef *RTC = &rtc;
+PWR_TypeDef *PWR = &pwr;
+EXTI_TypeDef *EXTI = &exti;
+SYSCFG_TypeDef *SYSCFG = &syscfg;
+USART_TypeDef *USART1 = &usart[0], *USART4 = &usart[1];
+GPIO_TypeDef *GPIOA = (GPIO_TypeDef *)stub_gpio, *GPIOB = (GPIO_TypeDef *)(stub_gpio+0x400),
+    *GPIOC = (GPIO_TypeDef *)(stub_gpio+0x800);
+FLASH_TypeDef *FLASH = &flash;
+
+void SystemCoreClockUpdate(void)
+{
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <string.h>
+#include "stm32f0xx.h"
+#include "adc.h"
+#include "gpio.h"
+
+/* Timing model of the ADC acquisition, on top of adc.c and the stand-in
+ * registers. TIM3 is stepped one tick (100 us) at a time from the values
+ * adc_start() left in ARR, CCR1 and DIER, each update event starts a
+ * sequence which ends with EOSEQ SEQUENCE_US later, and the interrupt
+ * handlers of adc.c are called where the hardware would. The VBAT
+ * divider is followed through the BSRR and BRR writes of gpio_set() and
+ * gpio_clear(). The duty cycles of the ADC and of the divider give the
+ * charge per sequence, with the currents of the comment in adc.c.
+ */
+
+#define TICK_US         100     // ADC_TIMER_CLOCK
+#define SEQUENCE_US     54      // 3 x 252 cycles at 14 MHz
+#define ADC_UA          1000    // ADC and HSI14 while converting
+#define DIVIDER_UA      100     // VBAT divider, assumed, depends on the board
+#define SIM_US          1000000
+
+static int fail;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); fail = 1; } } while (0)
+
+void TIM3_IRQHandler(void);
+void ADC1_IRQHandler(void);
+
+static int divider;
+
+// Pin changes since the last call. Only adc_start() both clears and 
+// sets the pin, in that order.
+static void follow_divider(void)
+{
+    uint32_t pin = 1 << PIN(GPIO_OUT_ADC_BAT);
+
+    if (PORT(GPIO_OUT_ADC_BAT)->BRR & pin)
+        divider = 0;
+    if (PORT(GPIO_OUT_ADC_BAT)->BSRR & pin)
+        divider = 1;
+    PORT(GPIO_OUT_ADC_BAT)->BSRR = 0;
+    PORT(GPIO_OUT_ADC_BAT)->BRR = 0;
+}
+
+static void run(uint32_t rate, int low_power)
+{
+    uint32_t us, divider_us = 0, adc_us = 0, sequences = 0;
+    uint32_t settled_us = 0, min_settled_us = ~0u;
+    double nc;
+
+    // adc_stop() waits for ADSTP to clear, the stand-in ADC stops at once
+    ADC1->CR = 0;
+    RCC->CR2 |= RCC_CR2_HSI14RDY;
+    memset((void *)TIM3, 0, sizeof(*TIM3));
+    divider = 0;
+
+    adc_set_low_power(low_power);
+    adc_start(rate);
+    follow_divider();
+
+    // One pass per tick, the events happen as CNT takes its value
+    for (us=0; us<SIM_US; us+=TICK_US)
+    {
+        int ended = 0;
+
+        if ((TIM3->CR1 & TIM_CR1_CEN) != 0)
+        {
+            if (TIM3->CNT == 0 && us > 0)
+            {
+                // update event: TRGO starts a sequence, EOSEQ comes
+                // within this tick
+                sequences++;
+                if (settled_us < min_settled_us)
+                    min_settled_us = divider ? settled_us : 0;
+                adc_us += SEQUENCE_US;
+                if ((ADC1->IER & ADC_IER_EOSEQIE) != 0)
+                {
+                    ADC1->ISR |= ADC_ISR_EOSEQ;
+                    ADC1_IRQHandler();
+                    ended = divider;
+                    follow_divider();
+                    ended = ended && !divider;
+                }
+            }
+            if (TIM3->CNT == TIM3->CCR1 && (TIM3->DIER & TIM_DIER_CC1IE) != 0)
+            {
+                TIM3_IRQHandler();
+                follow_divider();
+            }
+            TIM3->CNT = TIM3->CNT == TIM3->ARR ? 0 : TIM3->CNT+1;
+        }
+
+        if (ended)
+            divider_us += SEQUENCE_US;
+        if (divider)
+            divider_us += TICK_US, settled_us += TICK_US;
+        else
+            settled_us = 0;
+    }
+    if (!low_power)
+        adc_us = SIM_US;        // ADC enabled and HSI14 running throughout
+
+    nc = ((double)adc_us*ADC_UA + (double)divider_us*DIVIDER_UA) / 1000 / sequences;
+    printf("%4u Hz %s: %u sequences, divider %5.1f%%, ADC %5.1f%%, "
+        "settled >= %u us, %.0f nC per sequence\n",
+        rate, low_power ? "low power" : "always on", sequences,
+        100.0*divider_us/SIM_US, 100.0*adc_us/SIM_US, min_settled_us, nc);
+
+    // the last period ends with the simulation
+    CHECK(sequences == rate-1, "%u sequences at %u Hz", sequences, rate);
+    CHECK(min_settled_us >= 1000, "divider on for only %u us before a trigger", min_settled_us);
+    if (low_power && rate*1000 < SIM_US/2)
+    {
+        // on ADC_SETTLE ticks plus the sequence, per period
+        // one more settling time, before the update that ends the run
+        CHECK(divider_us <= sequences*(1000 + SEQUENCE_US) + 1000,
+            "divider on %u us at %u Hz", divider_us, rate);
+        CHECK(adc_us == sequences*SEQUENCE_US, "ADC on %u us at %u Hz", adc_us, rate);
+    }
+    else
+    {
+        CHECK(divider_us == SIM_US, "divider off while sampling at %u Hz", rate);
+    }
+
+    ADC1->CR = 0;
+    adc_stop();
+    follow_divider();
+    CHECK(!divider, "divider left on by adc_stop()");
+}
+
+int main(void)
+{
+    run(16, 0);
+    run(16, 1);
+    run(100, 1);
+    run(1000, 0);
+    run(1000, 1);
+    return fail;
+}
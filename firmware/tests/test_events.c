@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "stm32f0xx.h"
+#include "event.h"
+
+/* event.c against the stand-in core: __WFI() calls stub_wfi, which plays
+ * the interrupt handlers that would wake the core up, raising events
+ * from a script. Checks that event_wait() only sleeps when nothing is
+ * pending, returns every raised event exactly once, merges events raised
+ * together, and does not lose one raised while it was about to sleep.
+ */
+
+static int fail;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); fail = 1; } } while (0)
+
+// Events raised by the successive wakeups, 0 for a wakeup without event
+static const uint32_t *script;
+static uint32_t script_len;
+static uint32_t wfi_count;
+
+static void scripted_wfi(void)
+{
+    if (wfi_count < script_len && script[wfi_count] != 0)
+        event_raise(script[wfi_count]);
+    wfi_count++;
+    if (wfi_count > 1000)
+    {
+        printf("FAIL: event_wait() never returns\n");
+        exit(1);
+    }
+}
+
+static void play(const uint32_t *events, uint32_t len)
+{
+    script = events;
+    script_len = len;
+    wfi_count = 0;
+    stub_wfi = scripted_wfi;
+}
+
+static void pending_first(void)
+{
+    uint32_t events;
+
+    play(0, 0);
+    event_raise(EVENT_I2C_RX);
+    event_raise(EVENT_BUTTON);
+    CHECK(event_pending() == (EVENT_I2C_RX | EVENT_BUTTON), "pending %x", event_pending());
+    events = event_wait();
+    CHECK(events == (EVENT_I2C_RX | EVENT_BUTTON), "got %x", events);
+    CHECK(wfi_count == 0, "slept %u times with events pending", wfi_count);
+    CHECK(event_pending() == 0, "pending %x after event_wait()", event_pending());
+}
+
+static void sleep_until_event(void)
+{
+    static const uint32_t wakeups[] = { 0, 0, EVENT_RTC };
+    uint32_t events;
+
+    play(wakeups, 3);
+    events = event_wait();
+    CHECK(events == EVENT_RTC, "got %x", events);
+    CHECK(wfi_count == 3, "%u sleeps for 3 wakeups", wfi_count);
+}
+
+// A session of interrupts: every event comes out once, in a single
+// event_wait() per wakeup
+static void session(void)
+{
+    static uint32_t wakeups[600];
+    uint32_t raised = 0, got = 0, calls = 0, expected_calls = 0;
+    uint32_t count[11] = {0}, seen[11] = {0};
+
+    srand(1);
+    for (uint32_t i=0; i<600; i++)
+    {
+        // a few spurious wakeups, some with several sources at once
+        wakeups[i] = rand()%5 == 0 ? 0 : (1u << rand()%11) | (rand()%4 == 0 ? EVENT_TICK : 0);
+        if (i == 599)   // else the last event_wait() sleeps for good
+            wakeups[i] |= EVENT_TICK;
+        for (uint32_t b=0; b<11; b++)
+            count[b] += (wakeups[i] >> b) & 1;
+        if (wakeups[i] != 0)
+            expected_calls++;
+        raised |= wakeups[i];
+    }
+
+    play(wakeups, 600);
+    while (wfi_count < 600)
+    {
+        uint32_t events = event_wait();
+
+        calls++;
+        got |= events;
+        for (uint32_t b=0; b<11; b++)
+            seen[b] += (events >> b) & 1;
+    }
+    CHECK(got == raised, "got %x, raised %x", got, raised);
+    for (uint32_t b=0; b<11; b++)
+        CHECK(seen[b] == count[b], "event %x seen %u times, raised %u", 1u<<b, seen[b], count[b]);
+    CHECK(calls == expected_calls, "%u returns for %u wakeups with events", calls, expected_calls);
+    printf("session: %u wakeups, %u with events, %u returns from event_wait()\n",
+        wfi_count, expected_calls, calls);
+}
+
+int main(void)
+{
+    pending_first();
+    sleep_until_event();
+    session();
+    stub_wfi = 0;
+    return fail;
+}
@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "filter.h"
+
+/* filter.c on synthetic VBAT traces: step response of the IIR, spikes
+ * dropped by the median, noise reduction. A recorded trace, one mV value
+ * per line, may be given as argument: it is run through every setting
+ * and the spread of the input and output is printed.
+ */
+
+static int fail;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); fail = 1; } } while (0)
+
+// Samples until the output is within 1% of a 3900 to 3600 mV step
+static void step_response(uint8_t config)
+{
+    uint32_t shift = config & FILTER_SHIFT;
+    double a = 1.0 - 1.0/(1<<shift);
+    uint32_t bound = shift ? (uint32_t)ceil(log(0.01)/log(a)) + 2 : 1;
+    uint32_t n, y = 0, settled = 0;
+    filter_t f;
+
+    filter_reset(&f);
+    for (n=0; n<100; n++)
+        filter_update(&f, 3900, config);
+    for (n=1; n<=2000; n++)
+    {
+        y = filter_update(&f, 3600, config);
+        if (!settled && y <= 3603)
+            settled = n;
+    }
+    printf("config %02x: settles in %u samples (bound %u), final %u mV\n", config, settled, bound, y);
+    CHECK(settled != 0 && settled <= bound, "config %02x settles in %u samples", config, settled);
+    CHECK(y >= 3599 && y <= 3601, "config %02x ends at %u mV", config, y);
+}
+
+static void spike(void)
+{
+    uint32_t y, max = 0;
+    filter_t f;
+
+    filter_reset(&f);
+    for (uint32_t n=0; n<50; n++)
+    {
+        y = filter_update(&f, n == 25 ? 4500 : 3700, FILTER_MEDIAN | 2);
+        if (y > max)
+            max = y;
+    }
+    CHECK(max == 3700, "a single spike reaches the output, %u mV", max);
+
+    filter_reset(&f);
+    for (uint32_t n=0; n<50; n++)
+        y = filter_update(&f, n < 25 ? 3700 : 3500, FILTER_MEDIAN);
+    CHECK(y == 3500, "a step through the median alone ends at %u mV", y);
+}
+
+static double spread(const uint16_t *x, uint32_t n, uint32_t skip)
+{
+    double sum = 0, sum2 = 0;
+
+    for (uint32_t i=skip; i<n; i++)
+        sum += x[i], sum2 += (double)x[i]*x[i];
+    n -= skip;
+    return sqrt(sum2/n - (sum/n)*(sum/n));
+}
+
+static void run(const uint16_t *in, uint16_t *out, uint32_t n, uint8_t config)
+{
+    filter_t f;
+
+    filter_reset(&f);
+    for (uint32_t i=0; i<n; i++)
+        out[i] = filter_update(&f, in[i], config);
+}
+
+#define NOISY 4000
+
+static void noise(void)
+{
+    static uint16_t in[NOISY], out[NOISY];
+    double s_in, s_out;
+
+    srand(1);
+    for (uint32_t i=0; i<NOISY; i++)
+    {
+        in[i] = 3800 + rand()%41 - 20;
+        if (rand()%100 == 0)
+            in[i] += 300;       // glitch on the divider
+    }
+    s_in = spread(in, NOISY, 0);
+    run(in, out, NOISY, FILTER_MEDIAN | 3);
+    s_out = spread(out, NOISY, 50);
+    printf("noise: %.1f mV in, %.1f mV out\n", s_in, s_out);
+    CHECK(s_out*4 < s_in, "noise only down from %.1f to %.1f mV", s_in, s_out);
+}
+
+static void trace(const char *path)
+{
+    static uint16_t in[100000], out[100000];
+    static const uint8_t configs[] = {0, 2, 4, FILTER_MEDIAN, FILTER_MEDIAN|2, FILTER_MEDIAN|4};
+    FILE *f = fopen(path, "r");
+    uint32_t n = 0;
+    unsigned v;
+
+    if (f == 0)
+    {
+        perror(path);
+        exit(1);
+    }
+    while (n<sizeof(in)/sizeof(in[0]) && fscanf(f, "%u", &v) == 1)
+        in[n++] = v;
+    fclose(f);
+
+    printf("%s: %u samples, %.1f mV\n", path, n, spread(in, n, 0));
+    for (uint32_t c=0; c<sizeof(configs); c++)
+    {
+        run(in, out, n, configs[c]);
+        printf("  config %02x: %.1f mV\n", configs[c], spread(out, n, n>50 ? 50 : 0));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        trace(argv[1]);
+        return 0;
+    }
+    for (uint8_t shift=0; shift<=FILTER_SHIFT; shift++)
+        step_response(shift);
+    step_response(FILTER_MEDIAN | 3);
+    spike();
+    noise();
+    return fail;
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+
+/* history.c on a synthetic VBAT trace long enough to wrap the ring, with
+ * a step too large for one delta. The history is read back the way the
+ * host does, in I2C-sized chunks, decoded, and compared with the true
+ * per-minute average, minimum and maximum. A minute closed in the middle
+ * of a burst must not change what the burst returns, whether the burst
+ * starts at the header or in the middle of the entries.
+ */
+
+#define MINUTES     (HISTORY_MINUTES + 60)
+#define PER_MINUTE  60
+#define CHUNK       16      // bounce buffer of i2c_slave.c
+#define STEP_AT     (MINUTES - 100)
+#define MID         (HISTORY_HEADER + 2*100)
+
+static int fail;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); fail = 1; } } while (0)
+
+typedef struct {
+    uint16_t avg, min, max;
+} minute_t;
+
+static minute_t truth[MINUTES];
+
+// One read transaction from start to the end of the history
+static void burst(uint8_t *buf, uint32_t start, void (*between)(void))
+{
+    history_begin();
+    for (uint32_t offset=start; offset<HISTORY_BYTES; offset+=CHUNK)
+    {
+        uint32_t len = HISTORY_BYTES-offset < CHUNK ? HISTORY_BYTES-offset : CHUNK;
+
+        history_read(offset, buf+offset, len);
+        if (offset == start && between)
+            between();
+    }
+}
+
+// Decode a burst into minutes, oldest first, returns the count
+static uint32_t decode(const uint8_t *buf, minute_t *out, uint8_t *seq)
+{
+    int32_t avg = buf[0] | (buf[1]<<8);
+    uint32_t count = buf[2];
+
+    *seq = buf[3];
+    for (uint32_t i=0; i<count; i++)
+    {
+        const uint8_t *e = buf + HISTORY_HEADER + 2*i;
+
+        avg += (int8_t)e[0] * HISTORY_STEP;
+        out[i].avg = avg;
+        out[i].min = avg - (e[1]>>4)*HISTORY_SPREAD;
+        out[i].max = avg + (e[1]&15)*HISTORY_SPREAD;
+    }
+    return count;
+}
+
+static void check_against_truth(const uint8_t *buf, uint32_t minutes)
+{
+    static minute_t got[HISTORY_MINUTES];
+    uint8_t seq;
+    uint32_t count = decode(buf, got, &seq);
+    uint32_t first = minutes - count;
+    int32_t err, worst = 0;
+
+    CHECK(count == (minutes < HISTORY_MINUTES ? minutes : HISTORY_MINUTES),
+        "%u entries after %u minutes", count, minutes);
+    CHECK(seq == (uint8_t)minutes, "sequence %u after %u minutes", seq, minutes);
+
+    for (uint32_t i=0; i<count; i++)
+    {
+        const minute_t *t = &truth[first+i];
+
+        err = abs((int32_t)got[i].avg - t->avg);
+        // a step larger than a delta takes a minute to catch up
+        if (first+i != STEP_AT && err > worst)
+            worst = err;
+        CHECK(first+i == STEP_AT || err <= HISTORY_STEP/2 + 1,
+            "minute %u: average %u, expected %u", first+i, got[i].avg, t->avg);
+        CHECK(first+i == STEP_AT
+            || (got[i].min <= t->min + HISTORY_STEP && got[i].max + HISTORY_STEP >= t->max),
+            "minute %u: [%u, %u] does not cover [%u, %u]", first+i,
+            got[i].min, got[i].max, t->min, t->max);
+    }
+    printf("%u minutes: %u entries, worst average error %d mV\n", minutes, count, worst);
+}
+
+static void close_minute(void)
+{
+    history_close();
+}
+
+int main(void)
+{
+    static uint8_t buf[HISTORY_BYTES], before[HISTORY_BYTES];
+    uint32_t m;
+
+    srand(1);
+    for (m=0; m<MINUTES; m++)
+    {
+        uint32_t sum = 0;
+        uint16_t mv, base = 4100 - m - (m >= STEP_AT ? 400 : 0);
+
+        truth[m].min = 0xFFFF;
+        truth[m].max = 0;
+        for (uint32_t s=0; s<PER_MINUTE; s++)
+        {
+            mv = base + rand()%31 - 15;
+            history_add(mv);
+            sum += mv;
+            if (mv < truth[m].min)
+                truth[m].min = mv;
+            if (mv > truth[m].max)
+                truth[m].max = mv;
+        }
+        truth[m].avg = (sum + PER_MINUTE/2) / PER_MINUTE;
+        history_close();
+
+        if (m+1 == 100 || m+1 == HISTORY_MINUTES || m+1 == MINUTES-1)
+        {
+            burst(buf, 0, 0);
+            check_against_truth(buf, m+1);
+        }
+    }
+
+    // A minute closed after the first chunk: the burst is the one
+    // taken before it, the next burst has the new minute
+    burst(before, 0, 0);
+    history_add(3000);
+    burst(buf, 0, close_minute);
+    CHECK(memcmp(buf, before, HISTORY_BYTES) == 0, "burst changed by a minute closed during it");
+    burst(buf, 0, 0);
+    CHECK(memcmp(buf, before, HISTORY_BYTES) != 0, "the closed minute is missing from the next burst");
+    CHECK(buf[3] == (uint8_t)(MINUTES+1), "sequence %u after the closed minute", buf[3]);
+
+    // A burst started mid-table, with no read of the header since a 
+    // minute was closed, and another one closed after its first chunk:
+    // the full ring has moved on by exactly one entry since the last burst
+    memcpy(before, buf, HISTORY_BYTES);
+    history_add(3100);
+    history_close();
+    burst(buf, MID, close_minute);
+    CHECK(memcmp(buf+MID, before+MID+2, HISTORY_BYTES-MID-2) == 0,
+        "mid-table burst not served from a snapshot taken when it started");
+
+    return fail;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "soc.h"
+
+/* soc.c on discharge traces. The synthetic one is a constant-current
+ * discharge over DISCHARGE_MIN minutes, of a cell whose OCV curve is off
+ * the table of soc.c by up to CELL_SKEW mV, behind an internal resistance
+ * that drops LOAD_DROP mV, with noise. Voltages are fed once a second as
+ * main() does, soc_minute() runs once a minute. SoC and time to empty
+ * are checked against the true values.
+ *
+ * A recorded trace may be given as argument instead: a CSV file of
+ * minute,mV,state lines, with state 0 idle, 1 charging or 2 discharging
+ * as in soc.h, ending at the end of the discharge. It is replayed and the
+ * estimates are printed against the remaining time.
+ */
+
+#define DISCHARGE_MIN   240
+#define LOAD_DROP       55      // soc.c assumes SOC_LOAD_OFFSET, 60
+#define CELL_SKEW       10
+
+static int fail;
+
+#define CHECK(cond, ...) do { if (!(cond)) { printf("FAIL: " __VA_ARGS__); printf("\n"); fail = 1; } } while (0)
+
+// OCV of the simulated cell, soc in 0.1 %
+static double cell_ocv(double soc)
+{
+    static const double ocv[11] = {
+        3300, 3680, 3740, 3770, 3790, 3820, 3870, 3920, 3980, 4060, 4180
+    };
+    int i = soc >= 1000 ? 9 : (int)(soc/100);
+    double v = ocv[i] + (ocv[i+1]-ocv[i]) * (soc - 100*i) / 100;
+
+    // a different cell: skewed up when full, down when empty
+    return v + CELL_SKEW * (soc - 500) / 500;
+}
+
+static void synthetic(void)
+{
+    uint32_t soc = 0, tte, worst_soc = 0, worst_tte = 0, published = 0;
+
+    srand(1);
+    for (uint32_t m=0; m<DISCHARGE_MIN; m++)
+    {
+        for (uint32_t s=0; s<60; s++)
+        {
+            double t = m + s/60.0;
+            double truth = 1000.0 * (1 - t/DISCHARGE_MIN);
+            uint32_t mv = cell_ocv(truth) - LOAD_DROP + rand()%9 - 4;
+
+            soc = soc_update(mv, SOC_DISCHARGING);
+        }
+        soc_minute();
+        tte = soc_time_to_empty();
+
+        // true values at the end of minute m
+        uint32_t truth = 1000 * (DISCHARGE_MIN - m - 1) / DISCHARGE_MIN;
+        uint32_t left = DISCHARGE_MIN - m - 1;
+        uint32_t err = abs((int32_t)soc - (int32_t)truth);
+
+        if (err > worst_soc)
+            worst_soc = err;
+        CHECK(err <= 60, "minute %u: SoC %u.%u %%, expected %u.%u %%",
+            m, soc/10, soc%10, truth/10, truth%10);
+
+        if (tte == SOC_UNKNOWN)
+        {
+            CHECK(m < 10, "minute %u: no time to empty", m);
+            continue;
+        }
+        published++;
+        // the rate lags the slope changes of the curve, judge it away 
+        // from both ends of the discharge
+        if (left > 20 && m >= 20)
+        {
+            err = abs((int32_t)tte - (int32_t)left);
+            if (100*err/left > worst_tte)
+                worst_tte = 100*err/left;
+            CHECK(err <= left/4 + 5, "minute %u: %u minutes to empty, expected %u", m, tte, left);
+        }
+    }
+    printf("synthetic discharge: worst SoC error %u.%u %%, worst time to empty error %u %%, "
+        "%u estimates\n", worst_soc/10, worst_soc%10, worst_tte, published);
+
+    // back on external power
+    soc_update(4150, SOC_CHARGING);
+    CHECK(soc_time_to_empty() == SOC_UNKNOWN, "time to empty while charging");
+}
+
+// Time to full off the charger: 0 only once the charge is complete
+static void not_charging(void)
+{
+    soc_update(4150, SOC_FULL);
+    CHECK(soc_time_to_full() == 0, "time to full %u once charged", soc_time_to_full());
+    soc_update(4150, SOC_IDLE);
+    CHECK(soc_time_to_full() == SOC_UNKNOWN, "time to full %u on a fault or without battery",
+        soc_time_to_full());
+    soc_update(3900, SOC_DISCHARGING);
+    CHECK(soc_time_to_full() == SOC_UNKNOWN, "time to full %u while discharging",
+        soc_time_to_full());
+}
+
+static void recorded(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    unsigned minute, mv, last = 0, n = 0;
+    int state;
+    static struct { unsigned minute, soc, tte; } rows[100000];
+
+    if (f == 0)
+    {
+        perror(path);
+        exit(1);
+    }
+    while (n<sizeof(rows)/sizeof(rows[0]) && fscanf(f, "%u,%u,%d", &minute, &mv, &state) == 3)
+    {
+        rows[n].minute = minute;
+        rows[n].soc = soc_update(mv, state);
+        if (minute != last)
+            soc_minute();
+        last = minute;
+        rows[n].tte = soc_time_to_empty();
+        n++;
+    }
+    fclose(f);
+
+    printf("minute  SoC %%  to empty  left\n");
+    for (unsigned i=0; i<n; i++)
+    {
+        if (i+1 < n && rows[i+1].minute == rows[i].minute)
+            continue;
+        printf("%6u  %5.1f  %8d  %4u\n", rows[i].minute, rows[i].soc/10.0,
+            rows[i].tte == SOC_UNKNOWN ? -1 : (int)rows[i].tte, last - rows[i].minute);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        recorded(argv[1]);
+    else
+    {
+        synthetic();
+        not_charging();
+    }
+    return fail;
+}
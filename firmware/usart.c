@@ -1,6 +1,7 @@
 #include <stm32f0xx.h>
 #include <stm32f0_helpers.h>
 #include "usart.h"
+#include "event.h"
 
 unsigned usart_debug_enable = 0;
 
@@ -70,6 +71,21 @@ int usart_putc(int c)
   return 0;
 }
 
+void usart_enable_rx_interrupt(void)
+{
+  USART4->CR1 |= USART_CR1_RXNEIE;
+  NVIC_EnableIRQ(USART3_4_IRQn);
+}
+
+void USART3_4_IRQHandler(void)
+{
+  // Shared with USART3, which is not used. As for USART1, the character
+  // is left in RDR for usart_getc().
+  USART4->CR1 &= ~USART_CR1_RXNEIE;
+  USART4->ICR = USART_ICR_ORECF;
+  event_raise(EVENT_USART);
+}
+
 #else
 
 /* NOTES:
@@ -135,6 +151,21 @@ int usart_putc(int c)
   return 0;
 }
 
+void usart_enable_rx_interrupt(void)
+{
+  USART1->CR1 |= USART_CR1_RXNEIE;
+  NVIC_EnableIRQ(USART1_IRQn);
+}
+
+void USART1_IRQHandler(void)
+{
+  // The character is left in RDR for usart_getc(): disable the interrupt
+  // until the main loop has consumed it and re-enables it.
+  USART1->CR1 &= ~USART_CR1_RXNEIE;
+  USART1->ICR = USART_ICR_ORECF;
+  event_raise(EVENT_USART);
+}
+
 
 #endif
 
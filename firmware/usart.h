@@ -8,6 +8,7 @@ int usart_deinit();
 int usart_putc(int c);
 int usart_getc();
 int usart_available(void);
+void usart_enable_rx_interrupt(void);
 
 int usart_vprintf(const char *format, va_list ap);
 int usart_printf(const char *format, ...);
@@ -79,6 +79,7 @@ void SPI1_IRQHandler (void) __attribute__ ((weak,  alias ("default_handler")));
 void SPI2_IRQHandler (void) __attribute__ ((weak,  alias ("default_handler")));
 void USART1_IRQHandler (void) __attribute__ ((weak,  alias ("default_handler")));
 void USART2_IRQHandler (void) __attribute__ ((weak,  alias ("default_handler")));
+void USART3_4_IRQHandler (void) __attribute__ ((weak,  alias ("default_handler")));
 void CEC_CAN_IRQHandler (void) __attribute__ ((weak,  alias ("default_handler")));
 void USB_IRQHandler (void) __attribute__ ((weak,  alias ("default_handler")));
 
@@ -139,7 +140,7 @@ void (* const g_pfnVectors[])(void) = {
     [42] = SPI2_IRQHandler,
     [43] = USART1_IRQHandler,
     [44] = USART2_IRQHandler,
-    [45] = 0,
+    [45] = USART3_4_IRQHandler,
     [46] = CEC_CAN_IRQHandler,
     [47] = USB_IRQHandler,
 };